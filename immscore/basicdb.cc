@@ -117,6 +117,14 @@ void BasicDb::sql_create_tables()
                 "'trials' INTEGER NOT NULL);").execute();
 
         Q("CREATE INDEX Bias_uid_i ON Bias (uid);").execute();
+
+        Q("CREATE TABLE RatingStats ("
+                "'uid' INTEGER UNIQUE NOT NULL, "
+                "'journal' INTEGER NOT NULL, "
+                "'total' REAL NOT NULL, "
+                "'window' TEXT NOT NULL, "
+                "'biasmean' REAL NOT NULL, "
+                "'biastrials' REAL NOT NULL);").execute();
     }
     WARNIFFAILED();
 }
@@ -20,6 +20,7 @@
 #include <math.h>
 #include <time.h>
 #include <iostream>
+#include <algorithm>
 
 #include "flags.h"
 #include "correlate.h"
@@ -28,37 +29,63 @@
 
 using std::endl;
 using std::cerr;
+using std::pair;
+using std::set;
 
-#define CORRELATION_TIME    (15*30)   // n * 30 ==> n minutes
 #define MAX_CORR_STR        "12"
-#define MAX_CORRELATION     12
-#define SECOND_DEGREE       0.5
 #define PROCESSING_TIME     5000000
-
-CorrelationDb::CorrelationDb() : correlate_from(time(0))
+#define FLUSH_EVERY         60
+#define TOP_RELATED         64
+#define MAX_DEGREE          256
+#define MIN_CORRELATION     0.5
+#define COMPACT_SLICE       500
+
+CorrelationDb::CorrelationDb()
+    : graph_loaded(false), flushed(time(0)), data_version(-1),
+    journal_rowid(0), edges_updated(0), compact_next(0), sweep_began(0),
+    decay(1), pruned(0),
+    correlate_from(time(0))
 {
+    max_degree = get_config("correlation_degree", MAX_DEGREE);
+    half_life = get_config("correlation_half_life", 0);
+    compact = get_config("correlation_compact", 0);
     gettimeofday(&start, 0);
 }
 
+CorrelationDb::~CorrelationDb()
+{
+    flush_correlations();
+}
+
 void CorrelationDb::sql_create_tables()
 {
+    sql_create_correlations("C");
+
+    // Created on its own, so that existing databases get it too
     RuntimeErrorBlocker reb;
     try {
-        Q("CREATE TABLE C.Correlations ("
-                "'x' INTEGER NOT NULL, "
-                "'y' INTEGER NOT NULL, "
-                "'weight' INTEGER DEFAULT '0');").execute();
+        Q("CREATE TABLE C.Compaction ('began' TIMESTAMP NOT NULL);")
+            .execute();
+    }
+    IGNOREFAILURE();
+}
 
-        Q("CREATE TEMP TABLE TmpCorr ("
+void CorrelationDb::sql_create_correlations(const string &db)
+{
+    RuntimeErrorBlocker reb;
+    try {
+        Q("CREATE TABLE " + db + ".Correlations ("
                 "'x' INTEGER NOT NULL, "
                 "'y' INTEGER NOT NULL, "
                 "'weight' INTEGER DEFAULT '0');").execute();
 
-        Q("CREATE UNIQUE INDEX C.Correlations_x_y_i "
+        Q("CREATE UNIQUE INDEX " + db + ".Correlations_x_y_i "
                 "ON Correlations (x, y);").execute();
 
-        Q("CREATE INDEX C.Correlations_x_i ON Correlations (x);").execute();
-        Q("CREATE INDEX C.Correlations_y_i ON Correlations (y);").execute();
+        Q("CREATE INDEX " + db + ".Correlations_x_i "
+                "ON Correlations (x);").execute();
+        Q("CREATE INDEX " + db + ".Correlations_y_i "
+                "ON Correlations (y);").execute();
     }
     WARNIFFAILED();
 }
@@ -76,26 +103,71 @@ void CorrelationDb::add_recent(int uid, time_t skipped_at, int flags)
     }
 }
 
+// Strongest first, ties in sid order
+bool CorrelationDb::stronger(const Edge &a, const Edge &b)
+{
+    return a.weight > b.weight || (a.weight == b.weight && a.sid < b.sid);
+}
+
 void CorrelationDb::get_related(vector<int> &out, int pivot_sid, int limit)
 {
-    string query =
-        "SELECT pos FROM Filter NATURAL INNER JOIN Library "
-            "WHERE sid IN ("
-            "SELECT L.sid FROM C.Correlations AS C INNER JOIN Last AS L "
-                "ON CASE WHEN C.x = ? THEN C.y ELSE C.x END = L.sid "
-            "WHERE C.weight > 0 AND (C.x = ? OR C.y = ?) AND L.last > ? "
-            "ORDER BY C.weight DESC LIMIT " + itos(limit) + ");";
+    static const int BatchSize = 32;
+
+    if (pivot_sid < 0 || limit <= 0)
+        return;
+
+    // The top list is a prefix of the full ordering, which is only
+    // needed when not enough of the top is recent
+    const TopList &list = top_related(pivot_sid);
+    Edges related = list.edges;
+    bool complete = list.complete;
+
+    string last_query = "SELECT sid FROM Last WHERE last > ? AND sid IN ("
+        + sql_placeholders(BatchSize) + ");";
+    string pos_query = "SELECT pos FROM Filter NATURAL INNER JOIN Library "
+        "WHERE sid IN (" + sql_placeholders(BatchSize) + ");";
 
     try {
-        Q q(query);
+        // The strongest correlations among the recently played
+        vector<int> sids;
+        for (size_t from = 0; (int)sids.size() < limit; )
+        {
+            if (from >= related.size())
+            {
+                if (complete)
+                    break;
+                all_related(pivot_sid, related);
+                complete = true;
+                continue;
+            }
 
-        q << pivot_sid << pivot_sid << pivot_sid << (time(0) - HOUR);
+            size_t to = std::min(from + BatchSize, related.size());
 
-        while (q.next())
+            Q q(last_query);
+            q << (time(0) - HOUR);
+            for (size_t i = from; i < from + BatchSize; ++i)
+                q << (i < to ? related[i].sid : -1);
+
+            set<int> recent;
+            while (q.next())
+            {
+                int sid;
+                q >> sid;
+                recent.insert(sid);
+            }
+
+            for (; from < to && (int)sids.size() < limit; ++from)
+                if (recent.count(related[from].sid))
+                    sids.push_back(related[from].sid);
+        }
+
+        for (size_t from = 0; from < sids.size(); from += BatchSize)
         {
-            int pos;
-            q >> pos;
-            out.push_back(pos);
+            Q q(pos_query);
+            for (size_t i = from; i < from + BatchSize; ++i)
+                q << (i < sids.size() ? sids[i] : -1);
+
+            q.fetch(-1, out);
         }
     }
     WARNIFFAILED();
@@ -112,6 +184,48 @@ void CorrelationDb::maybe_expire_recent()
     start = now;
 
     expire_recent(time(0) - CORRELATION_TIME);
+
+    // Another process (immstool lint) edited the correlations: write
+    // out the edges changed here, then pick up everything else
+    if (graph_loaded && changed_elsewhere())
+    {
+        flush_correlations();
+        load_graph();
+    }
+
+    // A sweep rewrites every edge it decays or prunes, so the daemon
+    // only compacts when configured to
+    if (compact)
+        compact_correlations(COMPACT_SLICE);
+
+    if (flushed + FLUSH_EVERY < time(0))
+        flush_correlations();
+}
+
+void CorrelationDb::read_journal()
+{
+    // Only entries not seen before: each journal row is read once
+    Q q("SELECT Journal.rowid, Library.sid, Journal.played, "
+            "Journal.flags, Journal.time "
+            "FROM Journal INNER JOIN Library "
+            "ON Journal.uid = Library.uid "
+            "WHERE Journal.rowid > ? AND Journal.time > ? "
+            "ORDER BY Journal.time ASC, Journal.rowid ASC;");
+    q << journal_rowid << correlate_from;
+
+    while (q.next())
+    {
+        long rowid;
+        int flags;
+        time_t played;
+        JournalEntry entry;
+
+        q >> rowid >> entry.sid >> played >> flags >> entry.time;
+        entry.weight = Flags::deltify(played, flags);
+
+        journal_rowid = std::max(journal_rowid, rowid);
+        window.push_back(entry);
+    }
 }
 
 void CorrelationDb::expire_recent(time_t cutoff)
@@ -121,46 +235,59 @@ void CorrelationDb::expire_recent(time_t cutoff)
     StackTimer t;
 #endif
 
-    try {
-        AutoTransaction a;
-
-        while (1)
-        {
-            Q q("SELECT Library.sid, Journal.played, "
-                    "Journal.flags, Journal.time "
-                    "FROM Journal INNER JOIN Library "
-                    "ON Journal.uid = Library.uid "
-                    "WHERE Journal.time > ? ORDER BY Journal.time ASC;");
-            q << correlate_from;
+    struct timeval began, now;
+    gettimeofday(&began, 0);
 
-            if (!q.next())
-                break;
+    int entries = 0;
+    edges_updated = 0;
 
-            int flags;
-            time_t next, played;
+    try {
+        read_journal();
 
-            q >> from >> played >> flags >> next;
-            from_weight = Flags::deltify(played, flags);
+        // Every entry is correlated with all the entries after it in
+        // the window once it is older than the cutoff
+        while (!window.empty() && window.front().time <= cutoff)
+        {
+            JournalEntry first = window.front();
+            window.pop_front();
+            ++entries;
 
-            if (next > cutoff) 
-                break;
+            if (first.time <= correlate_from)
+                continue;
 
-            correlate_from = next + 1;
+            correlate_from = first.time + 1;
+            from = first.sid;
+            from_weight = first.weight;
 
             if (from_weight == -1)
                 continue;
 
-            while (q.next())
+            for (std::deque<JournalEntry>::iterator i = window.begin();
+                    i != window.end(); ++i)
             {
-                q >> to >> played >> flags;
-                to_weight = Flags::deltify(played, flags);
+                to = i->sid;
+                to_weight = i->weight;
                 expire_recent_helper();
             }
         }
-
-        a.commit();
     }
     WARNIFFAILED();
+
+    if (!entries)
+        return;
+
+    gettimeofday(&now, 0);
+
+    ++expire_stats.passes;
+    expire_stats.entries += entries;
+    expire_stats.edges += edges_updated;
+    expire_stats.usec += usec_diff(began, now);
+
+#ifdef DEBUG
+    cerr << "expired " << entries << " journal entries, updated "
+        << edges_updated << " correlations in "
+        << usec_diff(began, now) / 1000 << " ms" << endl;
+#endif
 }
 
 void CorrelationDb::expire_recent_helper()
@@ -191,31 +318,31 @@ void CorrelationDb::expire_recent_helper()
     if (usec_diff(start, now) > PROCESSING_TIME || fabs(weight) < 2)
         return;
     
-    try {
-        Q("DELETE FROM TmpCorr;").execute();
-    } IGNOREFAILURE();
-
-    {
-        string query("INSERT INTO TmpCorr SELECT x, y, weight "
-            "FROM C.Correlations "
-            "WHERE (x IN (?, ?) OR y IN (?, ?)) AND ");
-        query += (weight > 0 ? string("abs") : string("")) + " (weight) > 1;";
-
-        Q q(query);
-        q << to << from << to << from;
-        q.execute();
-    }
+    // Propagate through the correlations of either end, as they are now
+    struct Link { int node1, node2; float outer; };
+    vector<Link> links;
 
+    for (int end = 0; end < 2; ++end)
     {
-        Q q("SELECT * FROM TmpCorr;");
-        while (q.next())
+        int node = end ? from : to;
+        const Edges &edges = neighbours(node);
+        for (size_t i = 0; i < edges.size(); ++i)
         {
-            int node1, node2;
-            float outer;
-            q >> node1 >> node2 >> outer;
-            update_secondary_correlations(node1, node2, outer);
+            // The edge between the two ends is listed at both
+            if (end && edges[i].sid == to)
+                continue;
+            if ((weight > 0 ? fabs(edges[i].weight) : edges[i].weight) <= 1)
+                continue;
+
+            Link link = { std::min(node, edges[i].sid),
+                std::max(node, edges[i].sid), edges[i].weight };
+            links.push_back(link);
         }
     }
+
+    for (size_t i = 0; i < links.size(); ++i)
+        update_secondary_correlations(links[i].node1, links[i].node2,
+                links[i].outer);
 }
 
 void CorrelationDb::update_secondary_correlations(int node1, int node2,
@@ -244,41 +371,376 @@ void CorrelationDb::update_correlation(int from, int to, float weight)
         << std::max(from, to) << " by " << weight << endl;
 #endif
 
-    int min = std::min(from, to), max = std::max(from, to);
+    // Evidence for an existing edge adds up, within the usual bounds
+    float *current = find_edge(from, to);
+    if (current)
+        weight = std::max(std::min(*current + weight, (float)MAX_CORRELATION),
+                (float)-MAX_CORRELATION);
+
+    set_edge(from, to, weight);
+    ++edges_updated;
+}
+
+float CorrelationDb::correlate(int sid1, int sid2)
+{
+    if (sid1 < 0 || sid2 < 0)
+        return 0;
+
+    float *correlation = find_edge(sid1, sid2);
+    return correlation ? *correlation : 0;
+}
+
+void CorrelationDb::load_graph()
+{
+    graph_loaded = true;
+    graph.clear();
+    top.clear();
+    changed_elsewhere();
 
     try {
-        Q q("INSERT INTO C.Correlations "
-                "('x', 'y', 'weight') VALUES (?, ?, ?);");
-        q << min << max << weight;
-        q.execute();
+        Q q("SELECT x, y, weight FROM C.Correlations;");
+        while (q.next())
+        {
+            Edge edge;
+            int x;
+            q >> x >> edge.sid >> edge.weight;
+            if (x < 0 || edge.sid < 0)
+                continue;
+
+            int needed = std::max(x, edge.sid) + 1;
+            if ((int)graph.size() < needed)
+                graph.resize(needed);
+
+            graph[x].push_back(edge);
+            if (x != edge.sid)
+            {
+                std::swap(x, edge.sid);
+                graph[x].push_back(edge);
+            }
+        }
+    }
+    WARNIFFAILED();
+
+    for (size_t i = 0; i < graph.size(); ++i)
+        std::sort(graph[i].begin(), graph[i].end());
+}
+
+const CorrelationDb::Edges &CorrelationDb::neighbours(int sid)
+{
+    static const Edges none;
+
+    if (!graph_loaded)
+        load_graph();
+    if (sid < 0 || sid >= (int)graph.size())
+        return none;
+    return graph[sid];
+}
+
+float *CorrelationDb::find_edge(int sid1, int sid2)
+{
+    const Edges &edges = neighbours(sid1);
+    if (edges.empty())
+        return 0;
+
+    Edge key = { sid2, 0 };
+    Edges &list = graph[sid1];
+    Edges::iterator i = std::lower_bound(list.begin(), list.end(), key);
+    return i != list.end() && i->sid == sid2 ? &i->weight : 0;
+}
+
+void CorrelationDb::set_edge(int sid1, int sid2, float weight)
+{
+    if (sid1 < 0 || sid2 < 0)
         return;
-    } IGNOREFAILURE();
 
+    if (!graph_loaded)
+        load_graph();
+
+    int needed = std::max(sid1, sid2) + 1;
+    if ((int)graph.size() < needed)
+        graph.resize(needed);
+
+    for (int end = 0; end < (sid1 == sid2 ? 1 : 2); ++end)
     {
-        Q q("UPDATE C.Correlations SET weight = "
-                "max(min(weight + ?, " MAX_CORR_STR "), -" MAX_CORR_STR ") "
-                "WHERE x = ? AND y = ?;");
-        q << weight << min << max;
-        q.execute();
+        Edge edge = { end ? sid1 : sid2, weight };
+        Edges &list = graph[end ? sid2 : sid1];
+        Edges::iterator i = std::lower_bound(list.begin(), list.end(), edge);
+        if (i != list.end() && i->sid == edge.sid)
+            i->weight = weight;
+        else
+            list.insert(i, edge);
     }
+
+    update_top(sid1, sid2, weight);
+    if (sid1 != sid2)
+        update_top(sid2, sid1, weight);
+
+    dirty.insert(std::make_pair(std::min(sid1, sid2), std::max(sid1, sid2)));
 }
 
-float CorrelationDb::correlate(int sid1, int sid2)
+void CorrelationDb::all_related(int sid, Edges &out)
 {
-    if (sid1 < 0 || sid2 < 0)
-        return 0;
+    out.clear();
+    const Edges &edges = neighbours(sid);
+    for (size_t i = 0; i < edges.size(); ++i)
+        if (edges[i].weight > 0)
+            out.push_back(edges[i]);
+    std::sort(out.begin(), out.end(), stronger);
+}
+
+const CorrelationDb::TopList &CorrelationDb::top_related(int sid)
+{
+    static TopList none;
+
+    const Edges &edges = neighbours(sid);
+    if (edges.empty())
+    {
+        none.complete = true;
+        return none;
+    }
+
+    if ((int)top.size() <= sid)
+        top.resize(graph.size());
+
+    TopList &list = top[sid];
+    if (!list.stale)
+        return list;
+
+    list.edges.clear();
+    for (size_t i = 0; i < edges.size(); ++i)
+        if (edges[i].weight > 0)
+            list.edges.push_back(edges[i]);
+
+    list.complete = list.edges.size() <= TOP_RELATED;
+    size_t keep = std::min(list.edges.size(), (size_t)TOP_RELATED);
+    std::partial_sort(list.edges.begin(), list.edges.begin() + keep,
+            list.edges.end(), stronger);
+    list.edges.resize(keep);
+    list.stale = false;
+
+    return list;
+}
+
+void CorrelationDb::update_top(int sid, int other, float weight)
+{
+    if (sid >= (int)top.size() || top[sid].stale)
+        return;
+
+    TopList &list = top[sid];
+    Edges &edges = list.edges;
+
+    bool present = false, weakened = false;
+    for (Edges::iterator i = edges.begin(); i != edges.end(); ++i)
+    {
+        if (i->sid != other)
+            continue;
+        present = true;
+        weakened = weight < i->weight;
+        edges.erase(i);
+        break;
+    }
+
+    // A neighbour outside the list may now be stronger
+    if (weakened && !list.complete)
+    {
+        list.stale = true;
+        return;
+    }
+
+    if (weight <= 0)
+        return;
+
+    Edge edge = { other, weight };
+    Edges::iterator at =
+        std::lower_bound(edges.begin(), edges.end(), edge, stronger);
+
+    if (!present && !list.complete && at == edges.end())
+        return;
+
+    edges.insert(at, edge);
+    if (edges.size() > TOP_RELATED)
+    {
+        edges.pop_back();
+        list.complete = false;
+    }
+}
+
+void CorrelationDb::flush_correlations()
+{
+    flushed = time(0);
+
+    if (dirty.empty())
+        return;
+
+    vector<int> xs, ys, gone_xs, gone_ys;
+    vector<float> weights;
+    for (set<pair<int, int> >::iterator i = dirty.begin();
+            i != dirty.end(); ++i)
+    {
+        float *weight = find_edge(i->first, i->second);
+        if (weight)
+        {
+            xs.push_back(i->first);
+            ys.push_back(i->second);
+            weights.push_back(*weight);
+        }
+        else
+        {
+            gone_xs.push_back(i->first);
+            gone_ys.push_back(i->second);
+        }
+    }
 
-    int min = std::min(sid1, sid2), max = std::max(sid1, sid2);
-    float correlation = 0;
-    
     try {
-        Q q("SELECT weight FROM C.Correlations WHERE x = ? AND y = ?;");
-        q << min << max;
+        AutoTransaction a;
+
+        sql_insert_rows("INSERT OR REPLACE INTO C.Correlations "
+                "('x', 'y', 'weight') VALUES", "(?, ?, ?)", xs, ys, weights);
 
+        // Removed edges are batched through a temporary table, so that
+        // they too take a handful of statements rather than one each
+        if (!gone_xs.empty())
+        {
+            Q("CREATE TEMP TABLE IF NOT EXISTS DroppedCorrelations ("
+                    "'x' INTEGER, 'y' INTEGER);").execute();
+            sql_insert_rows("INSERT INTO DroppedCorrelations "
+                    "('x', 'y') VALUES", "(?, ?)", gone_xs, gone_ys);
+            Q("DELETE FROM C.Correlations WHERE rowid IN ("
+                    "SELECT cur.rowid FROM DroppedCorrelations gone, "
+                    "C.Correlations cur "
+                    "WHERE cur.x = gone.x AND cur.y = gone.y);")
+                .execute();
+            Q("DELETE FROM DroppedCorrelations;").execute();
+        }
+
+        a.commit();
+        dirty.clear();
+    }
+    WARNIFFAILED();
+}
+
+bool CorrelationDb::changed_elsewhere()
+{
+    // data_version only moves when another connection commits to the
+    // file. SQLite older than 3.8.8 returns nothing, and then changes
+    // made elsewhere are not noticed.
+    int version = -1;
+    try {
+        Q q("PRAGMA C.data_version;");
         if (q.next())
-            q >> correlation;
+            q >> version;
+    }
+    WARNIFFAILED();
+
+    bool changed = version != data_version && data_version != -1;
+    data_version = version;
+    return changed;
+}
+
+void CorrelationDb::remove_edge(int sid1, int sid2)
+{
+    if (!find_edge(sid1, sid2))
+        return;
+
+    for (int end = 0; end < (sid1 == sid2 ? 1 : 2); ++end)
+    {
+        Edge edge = { end ? sid1 : sid2, 0 };
+        Edges &list = graph[end ? sid2 : sid1];
+        list.erase(std::lower_bound(list.begin(), list.end(), edge));
+        update_top(end ? sid2 : sid1, edge.sid, 0);
+    }
+
+    dirty.insert(std::make_pair(std::min(sid1, sid2), std::max(sid1, sid2)));
+}
+
+static bool stronger_first(const pair<float, int> &a, const pair<float, int> &b)
+{
+    return a.first > b.first;
+}
+
+void CorrelationDb::compact_sid(int sid)
+{
+    const Edges &edges = neighbours(sid);
+
+    // Each edge is decayed once, from its lower end
+    if (decay < 1)
+        for (size_t i = 0; i < edges.size(); ++i)
+            if (edges[i].sid >= sid)
+                set_edge(sid, edges[i].sid, edges[i].weight * decay);
+
+    vector<int> drop;
+    vector<pair<float, int> > kept;
+    for (size_t i = 0; i < edges.size(); ++i)
+    {
+        if (fabs(edges[i].weight) < MIN_CORRELATION)
+            drop.push_back(edges[i].sid);
+        else
+            kept.push_back(std::make_pair(fabs(edges[i].weight),
+                        edges[i].sid));
+    }
+
+    if ((int)kept.size() > max_degree)
+    {
+        std::nth_element(kept.begin(), kept.begin() + max_degree, kept.end(),
+                stronger_first);
+        for (size_t i = max_degree; i < kept.size(); ++i)
+            drop.push_back(kept[i].second);
+    }
+
+    for (size_t i = 0; i < drop.size(); ++i)
+        remove_edge(sid, drop[i]);
+    pruned += drop.size();
+}
+
+bool CorrelationDb::compact_correlations(int budget)
+{
+    if (!graph_loaded)
+        load_graph();
+
+    if (!compact_next)
+    {
+        // Decay by the time since the previous sweep started, which is
+        // kept in C.Compaction across runs and between immsd and immstool
+        if (!sweep_began)
+        {
+            try {
+                Q q("SELECT max(began) FROM C.Compaction;");
+                if (q.next() && q.not_null())
+                    q >> sweep_began;
+            }
+            WARNIFFAILED();
+        }
+
+        time_t now = time(0);
+        decay = 1;
+        if (half_life > 0 && sweep_began)
+            decay = pow(0.5, (now - sweep_began) / (double)(half_life * DAY));
+        sweep_began = now;
+        pruned = 0;
+    }
+
+    for (; budget > 0 && compact_next < (int)graph.size(); --budget)
+        compact_sid(compact_next++);
+
+    if (compact_next < (int)graph.size())
+        return false;
+
+    // Only a finished sweep counts: write its edges out, then record it
+    flush_correlations();
+    try {
+        AutoTransaction a;
+        Q("DELETE FROM C.Compaction;").execute();
+        Q q("INSERT INTO C.Compaction ('began') VALUES (?);");
+        q << sweep_began;
+        q.execute();
+        a.commit();
     }
     WARNIFFAILED();
 
-    return correlation;
+#ifdef DEBUG
+    cerr << "compaction sweep pruned " << pruned << " correlations" << endl;
+#endif
+
+    compact_next = 0;
+    return true;
 }
@@ -22,27 +22,53 @@
 #include <sys/time.h>
 #include <string>
 #include <vector>
+#include <deque>
+#include <set>
+#include <utility>
 #include <climits>
 
 #include "immsconf.h"
 #include "basicdb.h"
 
+#define CORRELATION_TIME    (15*30)   // n * 30 ==> n minutes
+#define MAX_CORRELATION     12
+#define SECOND_DEGREE       0.5
+
 using std::string;
 
 class CorrelationDb : virtual public BasicDb
 {
 public:
     CorrelationDb();
+    virtual ~CorrelationDb();
 
     float correlate(int sid1, int sid2);
     void add_recent(int uid, time_t skipped_at, int flags);
     void clear_recent() { expire_recent(INT_MAX); }
     void expire_recent(time_t cutoff);
     void maybe_expire_recent();
+    // Write changed correlations back to C.Correlations
+    void flush_correlations();
+    // Create the Correlations table in the given attached database
+    static void sql_create_correlations(const string &db);
+    // Prune the graph a slice of sids at a time; returns true when
+    // a full sweep has been completed
+    bool compact_correlations(int budget);
+
+    // Throughput of expire_recent over the session
+    struct ExpireStats
+    {
+        ExpireStats() : passes(0), entries(0), edges(0), usec(0) {}
+        int passes, entries;
+        long edges;
+        double usec;
+    };
+    const ExpireStats &get_expire_stats() const { return expire_stats; }
 
 protected:
     void update_correlation(int from, int to, float weight);
     void expire_recent_helper();
+    void read_journal();
     void update_secondary_correlations(int from, int to, float outer);
 
     void get_related(std::vector<int> &out, int pivot_sid, int limit);
@@ -51,6 +77,71 @@ protected:
     virtual void sql_schema_upgrade(int) {}
 
 private:
+    // The correlation graph is kept in memory: for every sid, its
+    // neighbours sorted by sid. Each edge is stored at both ends.
+    struct Edge
+    {
+        int sid;
+        float weight;
+        bool operator<(const Edge &other) const { return sid < other.sid; }
+    };
+    typedef std::vector<Edge> Edges;
+    static bool stronger(const Edge &a, const Edge &b);
+
+    void load_graph();
+    // True if another process committed to C since the last call
+    bool changed_elsewhere();
+    const Edges &neighbours(int sid);
+    float *find_edge(int sid1, int sid2);
+    void set_edge(int sid1, int sid2, float weight);
+    void remove_edge(int sid1, int sid2);
+    void compact_sid(int sid);
+
+    // The strongest positive neighbours of each sid, strongest first.
+    // complete is set when the list holds all of them; a stale list
+    // is rebuilt from the graph when next read.
+    struct TopList
+    {
+        TopList() : complete(false), stale(true) {}
+        Edges edges;
+        bool complete, stale;
+    };
+
+    const TopList &top_related(int sid);
+    void all_related(int sid, Edges &out);
+    void update_top(int sid, int other, float weight);
+
+    std::vector<Edges> graph;
+    std::vector<TopList> top;
+    bool graph_loaded;
+    // (min, max) sid pairs changed since the last flush
+    std::set<std::pair<int, int> > dirty;
+    time_t flushed;
+    // PRAGMA data_version of C when last checked, or -1
+    int data_version;
+
+    // Journal entries not yet expired, in time order
+    struct JournalEntry
+    {
+        int sid, weight;
+        time_t time;
+    };
+    std::deque<JournalEntry> window;
+    long journal_rowid;
+
+    ExpireStats expire_stats;
+    int edges_updated;
+
+    // Compaction: whether the daemon runs it, strongest edges kept per
+    // sid, the decay half-life in days (0 to disable), and where the
+    // current sweep is
+    bool compact;
+    int max_degree, half_life;
+    int compact_next;
+    time_t sweep_began;
+    float decay;
+    long pruned;
+
     // shared within callbacks
     time_t correlate_from;
     int from, from_weight, to, to_weight;
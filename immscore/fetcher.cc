@@ -18,21 +18,37 @@
 */
 #include <stdlib.h>
 #include <unistd.h>
+#include <errno.h>
 
 #include <iostream>
 #include <algorithm>
+#include <map>
+#include <set>
 
 #include "fetcher.h"
 #include "strmanip.h"
 #include "immsutil.h"
 
+// Number of positions looked up by a single batch query
+#define     BATCH_SIZE      32
+
 using std::endl;
 using std::cerr;
+using std::map;
+using std::set;
+using std::vector;
 
 InfoFetcher::SongData::SongData(int _position, const string &_path)
     : Song(_path), rating(0), position(_position),
       relation(0), acoustic(0),
-      last_played(0), identified(false) {
+      last_played(0), last_time(0), identified(false), scored_for(-1) {
+}
+
+InfoFetcher::SongData::SongData(int _position, const string &_path,
+        int _uid, int _sid)
+    : Song(_path, _uid, _sid), rating(0), position(_position),
+      relation(0), acoustic(0),
+      last_played(0), last_time(0), identified(false), scored_for(-1) {
 }
 
 bool InfoFetcher::SongData::get_song_from_playlist()
@@ -71,6 +87,108 @@ bool InfoFetcher::fetch_song_info(SongData &data)
         return false;
     }
 
+    time_t last = data.get_last();
+    data.rating = data.get_rating();
+    journal.overlay(data.get_uid(), data.get_sid(), data.rating, last);
+    data.last_time = last;
+    data.last_played = time(0) - last;
+
+    finish_song_info(data);
+
+    return true;
+}
+
+void InfoFetcher::fetch_song_info(const vector<int> &positions,
+        vector<SongData> &result)
+{
+    static const string query =
+        "SELECT P.pos, P.path, L.uid, L.sid, IFNULL(R.rating, -1), "
+            "IFNULL(La.last, 0), I.title, A.artist "
+        "FROM Playlist P INNER JOIN Library L ON P.uid = L.uid "
+        "LEFT JOIN Ratings R ON R.uid = L.uid "
+        "LEFT JOIN Last La ON La.sid = L.sid "
+        "LEFT JOIN Info I ON I.sid = L.sid "
+        "LEFT JOIN Artists A ON A.aid = I.aid "
+        "WHERE P.pos IN (" + sql_placeholders(BATCH_SIZE) + ");";
+
+    map<int, SongData> found;
+
+    for (size_t start = 0; start < positions.size(); start += BATCH_SIZE)
+    {
+        try {
+            Q q(query);
+            for (size_t i = start; i < start + BATCH_SIZE; ++i)
+                q << (i < positions.size() ? positions[i] : -1);
+
+            while (q.next())
+            {
+                int pos, uid, sid, rating;
+                time_t last;
+                string path, title, artist;
+
+                q >> pos >> path >> uid >> sid >> rating >> last
+                    >> title >> artist;
+
+                journal.overlay(uid, sid, rating, last);
+
+                SongData data(pos, path, uid, sid);
+                if (sid >= 0)
+                    data.set_cached_info(artist, title);
+                data.rating = rating;
+                data.last_played = last;
+                found.insert(std::make_pair(pos, data));
+            }
+        }
+        WARNIFFAILED();
+    }
+
+    // Check the files after the database is done with. A directory that
+    // has gone missing (eg. unmounted media) is only looked at once.
+    set<string> missing_dirs;
+    time_t now = time(0);
+
+    for (vector<int>::const_iterator i = positions.begin();
+            i != positions.end(); ++i)
+    {
+        map<int, SongData>::iterator f = found.find(*i);
+        if (f == found.end())
+        {
+            // Not identified yet - take the slow path
+            string path = PlaylistDb::get_item_from_playlist(*i);
+            if (path == "")
+                continue;
+            SongData data(*i, path);
+            if (InfoFetcher::fetch_song_info(data))
+                result.push_back(data);
+            continue;
+        }
+
+        SongData &data = f->second;
+        const string &path = data.get_path();
+        string dir = path_get_dirname(path);
+
+        if (missing_dirs.count(dir))
+            continue;
+        if (access(path.c_str(), R_OK))
+        {
+            if (errno == ENOENT && access(dir.c_str(), F_OK))
+                missing_dirs.insert(dir);
+            continue;
+        }
+
+        // No rating yet - this will infer one
+        if (data.rating < 0)
+            data.rating = data.get_rating();
+        data.last_time = data.last_played;
+        data.last_played = now - data.last_played;
+
+        finish_song_info(data);
+        result.push_back(data);
+    }
+}
+
+void InfoFetcher::finish_song_info(SongData &data)
+{
     StringPair info = data.get_info();
 
     const string &artist = info.first;
@@ -81,17 +199,11 @@ bool InfoFetcher::fetch_song_info(SongData &data)
     else if ((data.identified = parse_song_info(data, info)))
         data.set_info(info);
 
-    data.rating = data.get_rating();
-
 #if defined(DEBUG) && 0
     cerr << "path:\t" << data.get_path() << endl;
     cerr << "artist:\t" << artist << endl;
     cerr << "title:\t" << title << endl;
 #endif
-
-    data.last_played = time(0) - data.get_last();
-
-    return true;
 }
 
 bool InfoFetcher::parse_song_info(const SongData &data, StringPair &info)
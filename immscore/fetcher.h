@@ -19,8 +19,11 @@
 #ifndef __FETCHER_H
 #define __FETCHER_H
 
+#include <vector>
+
 #include "immsconf.h"
 #include "immsdb.h"
+#include "journalwriter.h"
 #include "song.h"
 
 class InfoFetcher : virtual protected ImmsDb
@@ -32,22 +35,37 @@ protected:
     {
      public:
        SongData(int _position, const string &_path);
+       SongData(int _position, const string &_path, int _uid, int _sid);
        bool operator ==(const SongData &other) const
        { return position == other.position; }
 
        bool get_song_from_playlist();
+       void set_cached_info(const string &_artist, const string &_title)
+       { artist = _artist; title = _title; }
 
        int rating;
        int position;
        int relation, acoustic;
-       time_t last_played;
+       // Seconds since the last play as of fetching, and when that was
+       time_t last_played, last_time;
        bool identified;
+       int scored_for;
     };
 
     virtual bool fetch_song_info(SongData &data);
+    // Same as above for a whole batch of playlist positions at once.
+    // Positions that can not be fetched are left out of the result.
+    virtual void fetch_song_info(const std::vector<int> &positions,
+            std::vector<SongData> &result);
     virtual bool parse_song_info(const SongData &data, StringPair &info);
 
     bool identify_playlist_item(int pos);
+
+    // Songs played are recorded in the background
+    JournalWriter journal;
+
+private:
+    void finish_song_info(SongData &data);
 };
 
 #endif
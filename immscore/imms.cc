@@ -42,7 +42,6 @@ using std::ofstream;
 
 #define     MAX_TIME                21*DAY
 
-#define     MAX_CORRELATION         12.0
 #define     CORRELATION_IMPACT      40
 
 #define     LAST_EXPIRE             HOUR
@@ -51,11 +50,30 @@ using std::ofstream;
 
 #define     ACOUSTIC_IMPACT         40
 
+#define     SCORE_CACHE_SIZE        65536
+#define     PERSIST_SCORES          true
+#define     SAVE_SCORES_EVERY       (15*60)
+
+// Defaults for the metacandidate budgets in immsd.conf
+#define     RELATED_HANDPICKED      30
+#define     RELATED_LAST            20
+#define     ACOUSTIC_HANDPICKED     30
+#define     ACOUSTIC_LAST           20
+
 //////////////////////////////////////////////
 
 // Imms
-Imms::Imms(IMMSServer *server) : server(server)
+Imms::Imms(IMMSServer *server)
+    : unsourced_picks(0),
+      scores(SCORE_CACHE_SIZE, PERSIST_SCORES), scores_saved(time(0)),
+      server(server)
 {
+    related_handpicked = get_config("related_handpicked", RELATED_HANDPICKED);
+    related_last = get_config("related_last", RELATED_LAST);
+    acoustic_handpicked = get_config("acoustic_handpicked",
+            ACOUSTIC_HANDPICKED);
+    acoustic_last = get_config("acoustic_last", ACOUSTIC_LAST);
+
     last_skipped = last_jumped = false;
     local_max = MAX_TIME;
 
@@ -67,11 +85,35 @@ Imms::Imms(IMMSServer *server) : server(server)
 
     time_t t = time(0);
     fout << endl << endl << ctime(&t) << setprecision(3);
+
+    features.load();
+    if (neighbours.load(get_imms_root(ACOUSTIC_INDEX)))
+        neighbours.refresh(features);
+    else
+        neighbours.build(features);
+
+    ScoreCache::sql_create_tables();
+    scores.load();
 }
 
 Imms::~Imms()
 {
+    journal.stop();
+    print_ratings();
     clear_recent();
+    save_scores();
+    neighbours.save(get_imms_root(ACOUSTIC_INDEX));
+    print_source_stats();
+    print_journal_stats();
+}
+
+void Imms::save_scores()
+{
+    scores_saved = time(0);
+    scores.save();
+
+    fout << "[Score cache: " << scores.size() << " entries, "
+        << scores.hits << " hits, " << scores.misses << " misses]" << endl;
 }
 
 void Imms::setup(bool use_xidle)
@@ -83,10 +125,19 @@ void Imms::get_metacandidates(int size)
 {
     metacandidates.clear();
 
+    // A position offered by several sources is credited to the first
+    std::map<int, int> sources;
+
     if (handpicked.sid != -1)
-        CorrelationDb::get_related(metacandidates, handpicked.sid, 30);
+        CorrelationDb::get_related(metacandidates, handpicked.sid,
+                related_handpicked);
     if (last.sid != -1)
-        CorrelationDb::get_related(metacandidates, last.sid, 20);
+        CorrelationDb::get_related(metacandidates, last.sid, related_last);
+    note_sources(sources, Related);
+
+    get_acoustic_neighbours(handpicked, acoustic_handpicked);
+    get_acoustic_neighbours(last, acoustic_last);
+    note_sources(sources, Acoustic);
 
     sort(metacandidates.begin(), metacandidates.end());
     metacandidates.erase(
@@ -96,15 +147,110 @@ void Imms::get_metacandidates(int size)
     if ((int)metacandidates.size() < size)
         PlaylistDb::get_random_sample(metacandidates,
                 size - metacandidates.size());
+    note_sources(sources, Random);
+
+    for (std::map<int, int>::iterator i = sources.begin();
+            i != sources.end(); ++i)
+    {
+        candidate_sources[i->first] = i->second;
+        ++source_stats[i->second].offered;
+    }
 
     reverse(metacandidates.begin(), metacandidates.end());
 }
 
+void Imms::note_sources(std::map<int, int> &sources, int source)
+{
+    for (size_t i = 0; i < metacandidates.size(); ++i)
+        sources.insert(std::make_pair(metacandidates[i], source));
+}
+
+int Imms::select_next()
+{
+    int position = SongPicker::select_next();
+    if (position < 0)
+        return position;
+
+    std::map<int, int>::iterator i = candidate_sources.find(position);
+    if (i == candidate_sources.end())
+    {
+        // Got into the pool through the playlist sweep
+        ++unsourced_picks;
+        return position;
+    }
+
+    ++source_stats[i->second].picked;
+    candidate_sources.erase(i);
+    return position;
+}
+
+void Imms::print_source_stats()
+{
+    static const char *names[NumSources] = { "related", "acoustic", "random" };
+
+    fout << "[Candidate sources:";
+    for (int i = 0; i < NumSources; ++i)
+    {
+        const SourceStats &stats = source_stats[i];
+        fout << " " << names[i] << " " << stats.picked << "/" << stats.offered;
+        if (stats.offered)
+            fout << " (" << 100.0 * stats.picked / stats.offered << "%)";
+    }
+    fout << ", swept " << unsourced_picks << "]" << endl;
+}
+
+void Imms::print_journal_stats()
+{
+    const ExpireStats &stats = get_expire_stats();
+    if (!stats.passes)
+        return;
+
+    fout << "[Journal: " << stats.entries << " entries in "
+        << stats.passes << " passes, "
+        << stats.entries * 1e6 / std::max(stats.usec, 1.0) << " entries/s, "
+        << (double)stats.edges / stats.passes << " edges/pass]" << endl;
+}
+
+void Imms::get_acoustic_neighbours(const LastInfo &info, int limit)
+{
+    if (info.sid == -1 || !info.avalid)
+        return;
+
+    // Most of the library may not be in the playlist
+    vector<int> uids;
+    neighbours.nearest(AcousticView(info.mm, info.beats), limit * 4, uids,
+            info.uid);
+    PlaylistDb::get_positions_of(uids, metacandidates, limit);
+}
+
+void Imms::print_ratings()
+{
+    vector<pair<int, int> > rated;
+    journal.prune(rated);
+
+    for (size_t i = 0; i < rated.size(); ++i)
+        fout << "[" << rated[i].first << "] [After: " << rated[i].second
+            << "]" << endl;
+}
+
 void Imms::do_events()
 {
+    print_ratings();
+
     if (!SongPicker::do_events())
         CorrelationDb::maybe_expire_recent();
     XIdle::query();
+
+    features.refresh();
+    neighbours.refresh(features);
+    scores.refresh();
+    if (scores_saved + SAVE_SCORES_EVERY < time(0))
+    {
+        save_scores();
+        neighbours.save(get_imms_root(ACOUSTIC_INDEX));
+        print_source_stats();
+        print_journal_stats();
+    }
 }
 
 void Imms::request_playlist_item(int index)
@@ -119,6 +265,7 @@ void Imms::playlist_changed(int length)
 
     ImmsDb::clear_recent();
     PlaylistDb::playlist_clear();
+    candidate_sources.clear();
     SongPicker::playlist_changed();
 } 
 
@@ -164,6 +311,11 @@ void Imms::start_song(int position, string path)
             SongPicker::request_reschedule();
         }
 
+        // Assume the song will be played through, and score the next
+        // slot against it while it plays. end_song() undoes this if not.
+        prev_last = last;
+        set_lastinfo(last);
+
         at.commit();
     } 
     WARNIFFAILED();
@@ -215,7 +367,12 @@ void Imms::set_lastinfo(LastInfo &last)
     last.set_on = time(0);
     last.uid = current.get_uid();
     last.sid = current.get_sid();
-    last.avalid = current.get_acoustic(&last.mm, last.beats);
+
+    AcousticView view;
+    if ((last.avalid = features.find(last.uid, view)))
+        view.copy_to(&last.mm, last.beats);
+
+    SongPicker::request_rescore();
 }
 
 void Imms::end_song(bool at_the_end, bool jumped, bool bad)
@@ -252,30 +409,31 @@ void Imms::end_song(bool at_the_end, bool jumped, bool bad)
 #endif
 
     if (at_the_end && (!xidle_enabled || flags & Flags::active))
-        set_lastinfo(last);
+        last.set_on = time(0);
+    else
+    {
+        last = prev_last;
+        SongPicker::request_rescore();
+    }
 
     if (at_the_end && (flags & Flags::first || flags & Flags::jumped_to))
         set_lastinfo(handpicked);
 
-    last_jumped = jumped;
-
-    AutoTransaction at;
+    if (jumped)
+        SongPicker::invalidate_next();
 
-    ImmsDb::add_recent(current.get_uid(), played, flags);
-    int r = current.update_rating();
-    current.set_last(time(0));
-    current.increment_playcounter();
+    last_jumped = jumped;
 
-    at.commit();
+    journal.add(current.get_uid(), current.get_sid(), played, flags);
 
     fout << (jumped ? "[Jumped] " : "");
     fout << (!jumped && last_skipped ? "[Skipped] " : "");
-    fout << "[After: " << r << "]";
     fout << endl;
 
 }
 
-void Imms::evaluate_transition(SongData &data, LastInfo &last, float weight)
+void Imms::evaluate_transitions(vector<SongData*> &data, LastInfo &last,
+        float weight)
 {
     // Reset lasts if we had them for too long
     if (last.sid != -1 && last.set_on + LAST_EXPIRE < time(0))
@@ -284,20 +442,53 @@ void Imms::evaluate_transition(SongData &data, LastInfo &last, float weight)
     if (last.sid == -1)
         return;
 
-    float rel = cap(ImmsDb::correlate(
-                data.get_sid(), last.sid) / MAX_CORRELATION);
-    data.relation += ROUND(rel * weight * CORRELATION_IMPACT);
+    for (vector<SongData*>::iterator i = data.begin(); i != data.end(); ++i)
+    {
+        float rel = cap(ImmsDb::correlate(
+                    (*i)->get_sid(), last.sid) / MAX_CORRELATION);
+        (*i)->relation += ROUND(rel * weight * CORRELATION_IMPACT);
+    }
 
     if (!last.avalid)
         return;
 
-    MixtureModel mm;
-    float beats[BEATSSIZE];
-    if (!data.get_acoustic(&mm, beats))
-        return;
+    // Score everything that is not cached in one go
+    vector<float> score(data.size(), NAN);
+    vector<AcousticView> views;
+    vector<int> missed;
+
+    for (size_t i = 0; i < data.size(); ++i)
+    {
+        int uid = data[i]->get_uid();
+        if (scores.lookup(last.uid, uid, score[i]))
+            continue;
+
+        AcousticView view;
+        if (features.find(uid, view))
+        {
+            views.push_back(view);
+            missed.push_back(i);
+        }
+        else
+            scores.insert(last.uid, uid, NAN);
+    }
 
-    float score = model.evaluate(last.mm, last.beats, mm, beats);
-    data.acoustic += ROUND(score * weight * ACOUSTIC_IMPACT);
+    if (!views.empty())
+    {
+        vector<float> computed(views.size());
+        model.evaluate_batch(AcousticView(last.mm, last.beats),
+                &views[0], views.size(), &computed[0]);
+
+        for (size_t i = 0; i < missed.size(); ++i)
+        {
+            score[missed[i]] = computed[i];
+            scores.insert(last.uid, data[missed[i]]->get_uid(), computed[i]);
+        }
+    }
+
+    for (size_t i = 0; i < data.size(); ++i)
+        if (!isnan(score[i]))
+            data[i]->acoustic += ROUND(score[i] * weight * ACOUSTIC_IMPACT);
 }
 
 bool Imms::fetch_song_info(SongData &data)
@@ -308,10 +499,35 @@ bool Imms::fetch_song_info(SongData &data)
     if (data.last_played > local_max)
         data.last_played = local_max;
 
-    data.acoustic = data.relation = 0;
-
-    evaluate_transition(data, handpicked, 0.75);
-    evaluate_transition(data, last, (handpicked.sid == -1 ? 0.5 : 0.25));
+    vector<SongData*> rescore(1, &data);
+    rescore_candidates(rescore);
 
     return true;
 }
+
+void Imms::fetch_song_info(const vector<int> &positions,
+        vector<SongData> &result)
+{
+    InfoFetcher::fetch_song_info(positions, result);
+
+    vector<SongData*> rescore;
+    for (vector<SongData>::iterator i = result.begin();
+            i != result.end(); ++i)
+    {
+        if (i->last_played > local_max)
+            i->last_played = local_max;
+
+        rescore.push_back(&*i);
+    }
+
+    rescore_candidates(rescore);
+}
+
+void Imms::rescore_candidates(vector<SongData*> &data)
+{
+    for (vector<SongData*>::iterator i = data.begin(); i != data.end(); ++i)
+        (*i)->acoustic = (*i)->relation = 0;
+
+    evaluate_transitions(data, handpicked, 0.75);
+    evaluate_transitions(data, last, (handpicked.sid == -1 ? 0.5 : 0.25));
+}
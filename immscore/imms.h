@@ -22,15 +22,19 @@
 #include <string>
 #include <fstream>
 #include <memory>
+#include <map>
 
 #include "immsconf.h"
 #include "picker.h"
 #include "xidle.h"
 #include "serverstub.h"
+#include "scorecache.h"
 
 #include <analyzer/mfcckeeper.h>
 #include <analyzer/beatkeeper.h>
 #include <model/model.h>
+#include <model/featurestore.h>
+#include <model/acousticindex.h>
 
 // IMMS, UMMS, we all MMS for XMMS?
 
@@ -43,8 +47,9 @@ public:
 
     // Important inherited public methods
     //  SongPicker:
-    //      int select_next()
-    //      bool add_candidate(int, bool)
+    //      bool add_candidates(bool)
+
+    int select_next();
 
     void start_song(int position, std::string path);
     void end_song(bool at_the_end, bool jumped, bool bad);
@@ -79,21 +84,55 @@ protected:
     virtual void request_playlist_item(int index);
     virtual void get_metacandidates(int size);
     virtual void reset_selection();
+    virtual void rescore_candidates(std::vector<SongData*> &data);
 
     // Helper functions
     bool fetch_song_info(SongData &data);
+    void fetch_song_info(const std::vector<int> &positions,
+            std::vector<SongData> &result);
     void print_song_info();
     void set_lastinfo(LastInfo &last);
-    void evaluate_transition(SongData &data, LastInfo &last, float weight);
+    void evaluate_transitions(std::vector<SongData*> &data, LastInfo &last,
+            float weight);
+    void get_acoustic_neighbours(const LastInfo &info, int limit);
+    void note_sources(std::map<int, int> &sources, int source);
+    void save_scores();
+    void print_source_stats();
+    void print_journal_stats();
+    // Log the ratings written since the last call
+    void print_ratings();
 
     // State variables
     bool last_skipped, last_jumped;
-    int local_max;
 
     std::ofstream fout;
 
+    // Where metacandidates come from, and how often each source's
+    // candidates go on to be picked
+    enum { Related, Acoustic, Random, NumSources };
+    struct SourceStats
+    {
+        SourceStats() : offered(0), picked(0) {}
+        int offered, picked;
+    };
+    SourceStats source_stats[NumSources];
+    int unsourced_picks;
+    // Playlist position -> source that last offered it
+    std::map<int, int> candidate_sources;
+
+    // Metacandidates wanted from each source per round
+    int related_handpicked, related_last;
+    int acoustic_handpicked, acoustic_last;
+
     SVMSimilarityModel model;
+    FeatureStore features;
+    AcousticIndex neighbours;
+    ScoreCache scores;
+    time_t scores_saved;
     LastInfo handpicked, last;
+    // What last was before start_song() made the current song the
+    // tentative last one; restored if the current song does not count
+    LastInfo prev_last;
     IMMSServer *server;
 };
 
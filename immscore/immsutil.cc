@@ -31,6 +31,7 @@
 
 #include <iostream>
 #include <fstream>
+#include <map>
 
 #include "immsconf.h"
 #include "immsutil.h"
@@ -109,6 +110,38 @@ string get_imms_root(const string &file)
     return dotimms + file;
 }
 
+int get_config(const string &key, int def)
+{
+    static std::map<string, string> settings;
+    static bool loaded = false;
+
+    if (!loaded)
+    {
+        loaded = true;
+        ifstream conf(get_imms_root("immsd.conf").c_str());
+        string line;
+        while (getline(conf, line))
+        {
+            size_t eq = line.find('=');
+            if (line.empty() || line[0] == '#' || eq == string::npos)
+                continue;
+
+            string name = line.substr(0, eq), value = line.substr(eq + 1);
+            name.erase(name.find_last_not_of(" \t") + 1);
+            name.erase(0, name.find_first_not_of(" \t"));
+            settings[name] = value;
+        }
+    }
+
+    std::map<string, string>::const_iterator i = settings.find(key);
+    if (i == settings.end())
+        return def;
+
+    char *end;
+    long value = strtol(i->second.c_str(), &end, 10);
+    return end == i->second.c_str() ? def : value;
+}
+
 StackLockFile::StackLockFile(const string &_name) : name(_name)
 {
     while (1)
@@ -103,6 +103,10 @@ private:
 
 string get_imms_root(const string &file = "");
 
+// Integer setting from immsd.conf in the imms root, which holds one
+// "key = value" per line; def if it is not set there
+int get_config(const string &key, int def);
+
 string path_normalize(const string &path);
 
 float rms_string_distance(const string &s1, const string &s2,
@@ -0,0 +1,234 @@
+/*
+ IMMS: Intelligent Multimedia Management System
+ Copyright (C) 2001-2009 Michael Grigoriev
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+*/
+#include <chrono>
+#include <iostream>
+
+#include "journalwriter.h"
+#include "immsutil.h"
+#include "song.h"
+#include "sqldb2.h"
+
+// Seconds between attempts to write plays that failed to commit, and
+// how many attempts are made once stopping before they are given up
+#define     RETRY_DELAY         5
+#define     STOP_RETRIES        3
+
+using std::endl;
+using std::cerr;
+using std::pair;
+using std::vector;
+
+typedef std::unique_lock<std::mutex> Lock;
+
+JournalWriter::JournalWriter() : stopping(false), queued(0), settled(0)
+{
+}
+
+JournalWriter::~JournalWriter()
+{
+    stop();
+}
+
+void JournalWriter::add(int uid, int sid, time_t played, int flags)
+{
+    if (uid < 0)
+        return;
+
+    {
+        Lock lock(mutex);
+
+        if (!thread.joinable())
+        {
+            stopping = false;
+            thread = std::thread(&JournalWriter::run, this);
+        }
+
+        Play play = { uid, sid, flags, played, time(0), ++queued };
+        queue.push_back(play);
+
+        if (sid >= 0)
+        {
+            Last last = { play.at, play.seq };
+            lasts[sid] = last;
+        }
+    }
+    wakeup.notify_one();
+}
+
+void JournalWriter::stop()
+{
+    {
+        Lock lock(mutex);
+        if (!thread.joinable())
+            return;
+        stopping = true;
+    }
+    wakeup.notify_one();
+    thread.join();
+}
+
+void JournalWriter::overlay(int uid, int sid, int &rating, time_t &last)
+{
+    Lock lock(mutex);
+
+    std::map<int, Rating>::iterator r = ratings.find(uid);
+    if (r != ratings.end())
+        rating = r->second.rating;
+
+    std::map<int, Last>::iterator l = lasts.find(sid);
+    if (l != lasts.end())
+        last = std::max(last, l->second.last);
+}
+
+void JournalWriter::prune(vector<pair<int, int> > &rated)
+{
+    Lock lock(mutex);
+    drop_settled();
+    rated.swap(this->rated);
+    this->rated.clear();
+}
+
+void JournalWriter::drop_settled()
+{
+    for (std::map<int, Rating>::iterator i = ratings.begin();
+            i != ratings.end(); )
+    {
+        if (i->second.seq <= settled)
+            ratings.erase(i++);
+        else
+            ++i;
+    }
+
+    for (std::map<int, Last>::iterator i = lasts.begin(); i != lasts.end(); )
+    {
+        if (i->second.seq <= settled)
+            lasts.erase(i++);
+        else
+            ++i;
+    }
+}
+
+void JournalWriter::run()
+{
+    // This thread's own connection
+    SqlDb db;
+
+    std::deque<Play> plays;
+    int failures = 0;
+    while (true)
+    {
+        bool giving_up;
+        {
+            Lock lock(mutex);
+            if (failures)
+            {
+                if (!stopping)
+                    wakeup.wait_for(lock, std::chrono::seconds(RETRY_DELAY));
+            }
+            else
+                while (!stopping && queue.empty())
+                    wakeup.wait(lock);
+            if (queue.empty() && plays.empty())
+                break;
+            plays.insert(plays.end(), queue.begin(), queue.end());
+            queue.clear();
+            giving_up = stopping && failures >= STOP_RETRIES;
+        }
+
+        if (giving_up)
+        {
+            LOG(ERROR) << "could not record " << plays.size()
+                << " songs played" << endl;
+            // Their overlay entries must go too, or reads would go on
+            // seeing plays that never made it to the database. Giving up
+            // only happens in stop(), so no read is in progress.
+            {
+                Lock lock(mutex);
+                settled = plays.back().seq;
+                drop_settled();
+            }
+            plays.clear();
+            failures = 0;
+            continue;
+        }
+
+        if (write(plays))
+        {
+            plays.clear();
+            failures = 0;
+        }
+        else
+            ++failures;
+    }
+}
+
+bool JournalWriter::write(std::deque<Play> &plays)
+{
+    vector<pair<int, int> > done;
+    bool ok = false;
+
+    try {
+        // Take the write lock up front: the ratings read here must not
+        // go stale before they are written back
+        AutoTransaction a(true);
+
+        for (size_t i = 0; i < plays.size(); ++i)
+        {
+            const Play &play = plays[i];
+
+            Q q("INSERT INTO Journal VALUES (?, ?, ?, ?);");
+            q << play.uid << play.played << play.flags << play.at;
+            q.execute();
+
+            Song song("", play.uid, play.sid);
+            int rating = song.update_rating();
+            {
+                Lock lock(mutex);
+                Rating r = { rating, play.seq };
+                ratings[play.uid] = r;
+            }
+
+            song.set_last(play.at);
+            song.increment_playcounter();
+
+            done.push_back(std::make_pair(play.uid, rating));
+        }
+
+        // May wait for other processes to let go of the database
+        a.commit();
+        ok = true;
+    }
+    WARNIFFAILED();
+
+    if (!ok)
+    {
+        // A COMMIT that failed may have left the transaction open
+        try {
+            RuntimeErrorBlocker reb;
+            Q("ROLLBACK TRANSACTION;").execute();
+        }
+        IGNOREFAILURE();
+        return false;
+    }
+
+    Lock lock(mutex);
+    settled = plays.back().seq;
+    rated.insert(rated.end(), done.begin(), done.end());
+    return true;
+}
@@ -0,0 +1,104 @@
+/*
+ IMMS: Intelligent Multimedia Management System
+ Copyright (C) 2001-2009 Michael Grigoriev
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+*/
+#ifndef __JOURNALWRITER_H
+#define __JOURNALWRITER_H
+
+#include <time.h>
+
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "immsconf.h"
+
+// Records the songs played - the journal entry, the new rating, the
+// last played time and the play counter - on a thread of its own with
+// its own database connection, so that the main loop never waits on the
+// disk or on another process holding the database lock. Everything
+// queued while a commit is in progress goes into the next transaction.
+//
+// Until its transaction commits, what a play changes is kept in an
+// overlay for the picker to read: the last played time right away, and
+// the rating as soon as the writer has computed it. A transaction that
+// fails is retried, with whatever was queued since, a little later.
+class JournalWriter
+{
+public:
+    JournalWriter();
+    // Writes out whatever is still pending
+    ~JournalWriter();
+
+    void add(int uid, int sid, time_t played, int flags);
+    // Wait for everything queued to be written and stop the thread
+    void stop();
+
+    // Replace the values read from the database with any newer ones
+    void overlay(int uid, int sid, int &rating, time_t &last);
+    // Forget overlay entries that have been committed, and collect the
+    // (uid, rating) of the plays written since the last call. Must not be
+    // called with a read of the database in progress.
+    void prune(std::vector<std::pair<int, int> > &rated);
+
+private:
+    JournalWriter(const JournalWriter &);
+    JournalWriter &operator=(const JournalWriter &);
+
+    struct Play
+    {
+        int uid, sid, flags;
+        time_t played, at;
+        long seq;
+    };
+    struct Rating
+    {
+        int rating;
+        long seq;
+    };
+    struct Last
+    {
+        time_t last;
+        long seq;
+    };
+
+    void run();
+    // Drop the overlay entries up to settled; called with mutex held
+    void drop_settled();
+    // true if the plays were committed
+    bool write(std::deque<Play> &plays);
+
+    std::thread thread;
+    std::mutex mutex;
+    std::condition_variable wakeup;
+    bool stopping;
+
+    std::deque<Play> queue;
+    // Sequence numbers: the last play queued, and the last one that has
+    // been committed or given up on
+    long queued, settled;
+
+    std::map<int, Rating> ratings;
+    std::map<int, Last> lasts;
+    std::vector<std::pair<int, int> > rated;
+};
+
+#endif
@@ -0,0 +1,136 @@
+/*
+ IMMS: Intelligent Multimedia Management System
+ Copyright (C) 2001-2009 Michael Grigoriev
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+*/
+#include "lottery.h"
+#include "immsutil.h"
+
+using std::endl;
+using std::vector;
+
+void Lottery::clear()
+{
+    slots.clear();
+    buckets.clear();
+    tree.clear();
+    total_tickets = 0;
+}
+
+int Lottery::tickets(int position) const
+{
+    if (position < 0 || position >= (int)slots.size())
+        return 0;
+    return slots[position].tickets;
+}
+
+void Lottery::grow(int tickets)
+{
+    int size = std::max((int)tree.size(), 128);
+    while (size <= tickets)
+        size *= 2;
+
+    buckets.resize(size);
+    tree.assign(size, 0);
+
+    // Rebuild the Fenwick tree for the new size
+    for (int i = 1; i < size; ++i)
+    {
+        if (!buckets[i].empty())
+            tree[i] += i;
+        int parent = i + (i & -i);
+        if (parent < size)
+            tree[parent] += tree[i];
+    }
+}
+
+void Lottery::add_weight(int tickets, int delta)
+{
+    total_tickets += delta;
+    for (int i = tickets; i < (int)tree.size(); i += i & -i)
+        tree[i] += delta;
+}
+
+void Lottery::set(int position, int tickets)
+{
+    if (position < 0)
+        return;
+    if (position >= (int)slots.size())
+        slots.resize(position + 1);
+    if (tickets >= (int)tree.size())
+        grow(tickets);
+
+    Slot &slot = slots[position];
+    if (slot.tickets == tickets)
+        return;
+
+    if (slot.tickets)
+    {
+        vector<int> &bucket = buckets[slot.tickets];
+        int moved = bucket.back();
+        bucket[slot.index] = moved;
+        slots[moved].index = slot.index;
+        bucket.pop_back();
+        if (bucket.empty())
+            add_weight(slot.tickets, -slot.tickets);
+    }
+
+    slot.tickets = tickets;
+    slot.index = -1;
+
+    if (tickets > 0)
+    {
+        vector<int> &bucket = buckets[tickets];
+        if (bucket.empty())
+            add_weight(tickets, tickets);
+        slot.index = bucket.size();
+        bucket.push_back(position);
+    }
+}
+
+int Lottery::draw() const
+{
+    if (!total_tickets)
+        return -1;
+
+    int winning_ticket = imms_random(total_tickets);
+
+    // Descend the Fenwick tree to the first bucket whose prefix sum
+    // exceeds the winning ticket
+    int level = 0, step = 1;
+    while (step * 2 < (int)tree.size())
+        step *= 2;
+    for (; step; step /= 2)
+    {
+        int next = level + step;
+        if (next < (int)tree.size() && tree[next] <= winning_ticket)
+        {
+            level = next;
+            winning_ticket -= tree[next];
+        }
+    }
+
+    const vector<int> &bucket = buckets[level + 1];
+    return bucket[imms_random(bucket.size())];
+}
+
+void Lottery::dump(std::ostream &out) const
+{
+    for (int i = 1; i < (int)buckets.size(); ++i)
+        if (!buckets[i].empty())
+            out << i << ":" << buckets[i].size() << " ";
+    out << endl;
+}
@@ -0,0 +1,67 @@
+/*
+ IMMS: Intelligent Multimedia Management System
+ Copyright (C) 2001-2009 Michael Grigoriev
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+*/
+#ifndef __LOTTERY_H
+#define __LOTTERY_H
+
+#include <vector>
+#include <iostream>
+
+#include "immsconf.h"
+
+// Persistent weighted lottery over playlist positions.
+//
+// Every position holds some number of tickets. Positions holding the same
+// number of tickets share a bucket, and each non-empty bucket is as likely to
+// win as the number of tickets it represents; the winner is then picked
+// uniformly from within the bucket. The bucket weights live in a Fenwick tree
+// so both updates and draws are O(log(max tickets)).
+class Lottery
+{
+public:
+    Lottery() : total_tickets(0) {}
+
+    void clear();
+    void set(int position, int tickets);
+    void remove(int position) { set(position, 0); }
+    int tickets(int position) const;
+
+    bool empty() const { return !total_tickets; }
+    int total() const { return total_tickets; }
+
+    // Returns the winning position, or -1 if nobody holds any tickets.
+    int draw() const;
+
+    void dump(std::ostream &out) const;
+
+private:
+    struct Slot {
+        Slot() : tickets(0), index(-1) {}
+        int tickets, index;
+    };
+
+    void add_weight(int tickets, int delta);
+    void grow(int tickets);
+
+    std::vector<Slot> slots;
+    std::vector<std::vector<int> > buckets;
+    std::vector<int> tree;
+    int total_tickets;
+};
+
+#endif
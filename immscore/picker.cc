@@ -21,6 +21,7 @@
 #include <map>
 
 #include <math.h>
+#include <time.h>
 
 #include "picker.h"
 #include "strmanip.h"
@@ -29,6 +30,11 @@
 #define     SAMPLE_SIZE             100
 #define     MIN_SAMPLE_SIZE         35
 #define     MAX_ATTEMPTS            (SAMPLE_SIZE*2)
+#define     RESCORE_BATCH           20
+#define     SWEEP_BATCH             16
+#define     FETCH_BATCH             16
+// At RESCORE_BATCH every 500ms, rescoring all of it takes 25 seconds
+#define     MAX_POOL                1000
 
 using std::endl;
 using std::cerr;
@@ -40,8 +46,9 @@ static inline int get_tickets_for_rating(double r) {
 }
 
 SongPicker::SongPicker()
-    : current(0, "current"), pl_length(0),
-      acquired(0), winner(0, "winner")
+    : current(0, "current"), pl_length(0), local_max(0),
+      acquired(0), context(0), next(-1), winner(0, "winner"),
+      tallied_cap(0)
 {
     reschedule_requested = playlist_known = 0;
     reset();
@@ -50,6 +57,20 @@ SongPicker::SongPicker()
 void SongPicker::reset()
 {
     candidates.clear();
+    lottery.clear();
+    rescore_queue.clear();
+    aging.clear();
+    capped = 0;
+    max_elapsed = 0;
+    sweep_start = -1;
+    sweep_from = 0;
+    sweep_wrapped = false;
+    next = -1;
+    next_round();
+}
+
+void SongPicker::next_round()
+{
     metacandidates.clear();
     acquired = attempts = 0;
     selection_ready = false;
@@ -57,46 +78,309 @@ void SongPicker::reset()
         --reschedule_requested;
 }
 
-void SongPicker::playlist_changed()
+static bool better_rated(const std::pair<int, int> &x,
+        const std::pair<int, int> &y)
 {
-    playlist_known = 0;
-    reset();
+    return x.first > y.first;
 }
 
-bool SongPicker::add_candidate(bool urgent)
+void SongPicker::request_rescore()
 {
-    int want = urgent ? MIN_SAMPLE_SIZE : SAMPLE_SIZE;
-    if (candidates.empty() && metacandidates.empty())
-        get_metacandidates(want);
+    ++context;
+    next = -1;
+
+    // Everything is stale now. The songs near the new context get queued
+    // in front as add_candidates() comes across them; the rest follow,
+    // best rated first, since those are the likeliest winners.
+    lottery.clear();
+    vector<std::pair<int, int> > ranked;
+    for (Candidates::iterator i = candidates.begin();
+            i != candidates.end(); ++i)
+        ranked.push_back(std::make_pair(i->second.rating, i->first));
+    std::stable_sort(ranked.begin(), ranked.end(), better_rated);
+
+    rescore_queue.clear();
+    for (size_t i = 0; i < ranked.size(); ++i)
+        rescore_queue.push_back(ranked[i].second);
+
+    // Pull in candidates related to the new context as well
+    metacandidates.clear();
+    acquired = attempts = 0;
+    selection_ready = false;
+}
 
-    if (attempts > MAX_ATTEMPTS) return false;
-    ++attempts;
+time_t SongPicker::elapsed(const SongData &data, time_t now) const
+{
+    // Songs never played have a last_time of 0, and get the cap
+    return std::max((time_t)0,
+            std::min(now - data.last_time, (time_t)local_max));
+}
 
-    if (acquired >= want || metacandidates.empty()) return false;
+int SongPicker::get_tickets(const SongData &data, time_t now)
+{
+    double effective_rating = data.rating + data.relation + data.acoustic;
+    // Penalize the rating linearly based on how recently this song was
+    // played compared to other candidates.
+    if (max_elapsed)
+        effective_rating *= (double)elapsed(data, now) / max_elapsed;
+    return get_tickets_for_rating(effective_rating);
+}
 
-    int position = metacandidates.back();
-    metacandidates.pop_back();
+void SongPicker::classify(const SongData &data, time_t now)
+{
+    if (elapsed(data, now) < local_max)
+        aging.insert(data.position);
+    else
+        ++capped;
+}
 
-    string path = ImmsDb::get_item_from_playlist(position);
+void SongPicker::retally()
+{
+    // Pool entries stay resident, so their recency is aged here. Only
+    // the songs played recently enough to still be aging change tickets,
+    // unless the longest elapsed time, which scales everyone, moves.
+    time_t now = time(0);
+    bool all = tallied_cap != local_max;
+    if (all)
+    {
+        aging.clear();
+        capped = 0;
+        for (Candidates::iterator i = candidates.begin();
+                i != candidates.end(); ++i)
+            classify(i->second, now);
+        tallied_cap = local_max;
+    }
 
-    request_playlist_item(position);
+    time_t longest = 0;
+    for (std::set<int>::iterator i = aging.begin(); i != aging.end();)
+    {
+        time_t e = elapsed(candidates.find(*i)->second, now);
+        if (e >= local_max)
+        {
+            ++capped;
+            aging.erase(i++);
+        }
+        else
+        {
+            longest = std::max(longest, e);
+            ++i;
+        }
+    }
+    if (capped)
+        longest = local_max;
 
-    if (path == "") return false;
+    all = all || longest != max_elapsed;
+    max_elapsed = longest;
 
-    SongData data(position, path);
+    if (!all)
+    {
+        for (std::set<int>::iterator i = aging.begin(); i != aging.end(); ++i)
+        {
+            const SongData &data = candidates.find(*i)->second;
+            if (data.scored_for == context)
+                lottery.set(*i, get_tickets(data, now));
+        }
+        return;
+    }
 
-    // TODO(mag): dedupe during meta candidate generation?
-    if (find(candidates.begin(), candidates.end(), data) != candidates.end())
-        return true;
+    for (Candidates::iterator i = candidates.begin();
+            i != candidates.end(); ++i)
+    {
+        if (i->second.scored_for == context)
+            lottery.set(i->first, get_tickets(i->second, now));
+        else
+            lottery.remove(i->first);
+    }
+}
+
+int SongPicker::draw()
+{
+    retally();
+    return lottery.draw();
+}
+
+void SongPicker::add_to_pool(const SongData &data)
+{
+    time_t now = time(0);
+
+    Candidates::iterator i = candidates.find(data.position);
+    if (i != candidates.end())
+    {
+        if (!aging.erase(data.position))
+            --capped;
+        i->second = data;
+    }
+    else
+    {
+        if (candidates.size() >= MAX_POOL)
+            evict_weakest(next);
+        candidates.insert(Candidates::value_type(data.position, data));
+    }
+    classify(data, now);
+
+    if (elapsed(data, now) > max_elapsed)
+        retally();
+    else
+        lottery.set(data.position, get_tickets(data, now));
+}
+
+void SongPicker::remove_from_pool(int position)
+{
+    if (candidates.erase(position) && !aging.erase(position))
+        --capped;
+    lottery.remove(position);
+}
 
-    if (fetch_song_info(data))
+void SongPicker::evict_weakest(int keep)
+{
+    Candidates::iterator weakest = candidates.end();
+    for (Candidates::iterator i = candidates.begin();
+            i != candidates.end(); ++i)
+        if (i->first != keep && (weakest == candidates.end()
+                    || i->second.rating < weakest->second.rating))
+            weakest = i;
+
+    if (weakest != candidates.end())
+        remove_from_pool(weakest->first);
+}
+
+bool SongPicker::rescore_stale(int limit)
+{
+    vector<SongData*> stale;
+
+    while (limit > 0 && !rescore_queue.empty())
+    {
+        Candidates::iterator i = candidates.find(rescore_queue.front());
+        rescore_queue.pop_front();
+        if (i == candidates.end() || i->second.scored_for == context)
+            continue;
+        stale.push_back(&i->second);
+        --limit;
+    }
+
+    // Only the terms that depend on the context are recomputed
+    rescore_candidates(stale);
+
+    time_t now = time(0);
+    for (vector<SongData*>::iterator j = stale.begin(); j != stale.end(); ++j)
     {
-        ++acquired;
-        candidates.push_back(data);
-        if (urgent && data.rating > 80)
-            attempts = MAX_ATTEMPTS + 1;
+        (*j)->scored_for = context;
+        lottery.set((*j)->position, get_tickets(**j, now));
     }
 
+    return !rescore_queue.empty();
+}
+
+int SongPicker::count_scored() const
+{
+    int scored = 0;
+    for (Candidates::const_iterator i = candidates.begin();
+            i != candidates.end(); ++i)
+        if (i->second.scored_for == context)
+            ++scored;
+    return scored;
+}
+
+void SongPicker::sweep_playlist(int limit)
+{
+    if (sweep_from < 0)
+        return;
+
+    // Start somewhere random, so that a playlist longer than the pool
+    // is not always drawn from its head
+    if (sweep_start < 0)
+        sweep_start = sweep_from = imms_random(pl_length);
+
+    vector<int> positions;
+    PlaylistDb::get_filtered_positions(positions, sweep_from, limit);
+
+    // After wrapping around, stop where the lap started
+    if (sweep_wrapped)
+        positions.erase(std::lower_bound(positions.begin(), positions.end(),
+                    sweep_start), positions.end());
+
+    if (positions.empty())
+    {
+        if (!sweep_wrapped && sweep_start > 0)
+        {
+            sweep_wrapped = true;
+            sweep_from = 0;
+        }
+        else
+            sweep_from = -1;
+        return;
+    }
+
+    sweep_from = positions.back() + 1;
+    add_positions(positions);
+}
+
+void SongPicker::playlist_changed()
+{
+    playlist_known = 0;
+    reset();
+}
+
+int SongPicker::add_positions(const vector<int> &positions)
+{
+    vector<int> wanted;
+    for (vector<int>::const_iterator i = positions.begin();
+            i != positions.end(); ++i)
+        if (!candidates.count(*i))
+            wanted.push_back(*i);
+
+    vector<SongData> fetched;
+    if (!wanted.empty())
+        fetch_song_info(wanted, fetched);
+
+    int best = -1;
+    for (vector<SongData>::iterator i = fetched.begin();
+            i != fetched.end(); ++i)
+    {
+        i->scored_for = context;
+        add_to_pool(*i);
+        best = std::max(best, i->rating);
+    }
+    return best;
+}
+
+bool SongPicker::add_candidates(bool urgent)
+{
+    int want = urgent ? MIN_SAMPLE_SIZE : SAMPLE_SIZE;
+    if (!attempts && metacandidates.empty())
+        get_metacandidates(want);
+
+    if (attempts > MAX_ATTEMPTS) return false;
+    if (acquired >= want || metacandidates.empty()) return false;
+
+    vector<int> positions;
+    while ((int)positions.size() < FETCH_BATCH && !metacandidates.empty())
+    {
+        int position = metacandidates.back();
+        metacandidates.pop_back();
+        ++attempts;
+
+        request_playlist_item(position);
+        // Metacandidates that are already in the pool count as well,
+        // and are the first to be rescored if they are stale
+        Candidates::iterator i = candidates.find(position);
+        if (i == candidates.end())
+            positions.push_back(position);
+        else
+        {
+            if (i->second.scored_for != context)
+                rescore_queue.push_front(position);
+            ++acquired;
+        }
+    }
+
+    size_t before = candidates.size();
+    int best = add_positions(positions);
+    acquired += candidates.size() - before;
+
+    if (urgent && best > 80)
+        attempts = MAX_ATTEMPTS + 1;
+
     return true;
 }
 
@@ -105,16 +389,29 @@ bool SongPicker::do_events()
     if (!playlist_known || !pl_length)
         return true;
 
-    for (int i = 0; i < 5 && !selection_ready ; ++i)
-        if (!add_candidate())
+    if (!selection_ready && !add_candidates())
+        selection_ready = true;
+
+    bool stale = rescore_stale(RESCORE_BATCH);
+
+    if (selection_ready)
+    {
+        // Pick the winner for the next slot now, so that select_next()
+        // has it ready. Whatever is scored for the current context so far
+        // will do, once that is a fair sample: the most relevant songs
+        // are rescored first.
+        if (next < 0 && (!stale || count_scored() >= MIN_SAMPLE_SIZE))
         {
-            selection_ready = true;
+            next = draw();
             if (reschedule_requested)
             {
                 reschedule_requested = 0;
                 reset_selection();
             }
         }
+        if (!stale)
+            sweep_playlist(SWEEP_BATCH);
+    }
 
     if (playlist_known == 2)
         return false;
@@ -131,6 +428,11 @@ bool SongPicker::do_events()
 
 void SongPicker::revalidate_current(int pos, const string &path)
 {
+    // Whatever is playing now should not be picked again from the pool
+    remove_from_pool(pos);
+    if (next == pos)
+        next = -1;
+
     if (winner.position == pos && winner.get_path() == path)
     {
         current = winner;
@@ -144,78 +446,49 @@ void SongPicker::revalidate_current(int pos, const string &path)
 
 int SongPicker::select_next()
 {
-    if (PlaylistDb::get_real_playlist_length() < pl_length)
-        return -1;
+    int position = next;
+    next = -1;
 
-    if (add_candidate())
-        request_reschedule();
-    if (candidates.size() < MIN_SAMPLE_SIZE)
-        while (add_candidate(true));
-
-    if (candidates.empty())
+    if (position < 0 || !candidates.count(position))
     {
-        LOG(ERROR) << "warning: no candidates!" << endl;
-        return 0;
-    }
+        // Nothing ready yet: answer from the pool now, and have the
+        // client ask again once the speculative pick is available.
+        request_reschedule();
 
-    typedef map<int, vector<const SongData *> > Ratings;
-    Ratings ratings;
+        if (candidates.size() < MIN_SAMPLE_SIZE)
+        {
+            if (PlaylistDb::get_real_playlist_length() < pl_length)
+            {
+                if (lottery.empty())
+                    return -1;
+            }
+            else
+                while (add_candidates(true));
+        }
 
-    double max_last_played = 0;
-    for (Candidates::const_iterator i = candidates.begin();
-         i != candidates.end(); ++i) {
-      if (i->last_played > max_last_played)
-        max_last_played = i->last_played;
+        // Only the candidates scored for this context take part
+        if (lottery.empty())
+            rescore_stale(MIN_SAMPLE_SIZE);
+        position = draw();
     }
 
-    int total = 0;
-    for (Candidates::const_iterator i = candidates.begin();
-            i != candidates.end(); ++i) {
-        double effective_rating = i->rating + i->relation + i->acoustic;
-        // Penalize the rating linearly based on how recently this song was
-        // played compared to other candidates.
-        if (max_last_played)
-            effective_rating *= (i->last_played / max_last_played);
-        int tickets = get_tickets_for_rating(effective_rating);
-        vector<const SongData*>& bucket = ratings[tickets];
-        if (bucket.empty())
-            total += tickets;
-        bucket.push_back(&*i);
+    if (position < 0)
+    {
+        LOG(ERROR) << "warning: no candidates!" << endl;
+        return 0;
     }
 
-    int winning_ticket = imms_random(total);
-
 #ifdef DEBUG
     cerr << string(80, '-') << endl;
     cerr << " >>> ";
-#endif
-    for (Ratings::iterator i = ratings.begin(); i != ratings.end(); ++i)
-    {
-#ifdef DEBUG
-        cerr << i->first << ":" << i->second.size();
-#endif
-        winning_ticket -= i->first;
-        if (winning_ticket < 0)
-        {
-#ifdef DEBUG
-            cerr << "* ";
-#endif
-            winner = *i->second[imms_random(i->second.size())];
-#ifndef DEBUG
-            break;
-        }
-#else
-            winning_ticket = INT_MAX;
-        }
-        else
-            cerr << " ";
-#endif
-    }
-#ifdef DEBUG
-    cerr << endl;
+    lottery.dump(cerr);
+    cerr << " >>> winner: " << position << " with "
+        << lottery.tickets(position) << " of " << lottery.total() << endl;
 #endif
 
-    reset();
+    winner = candidates.find(position)->second;
+    remove_from_pool(position);
+    next_round();
 
     return winner.position;
 }
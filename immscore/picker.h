@@ -20,11 +20,14 @@
 #define __PICKER_H
 
 #include <string>
-#include <list>
+#include <map>
+#include <set>
+#include <deque>
 #include <vector>
 
 #include "immsconf.h"
 #include "fetcher.h"
+#include "lottery.h"
 
 class SongPicker : protected InfoFetcher
 {
@@ -37,30 +40,74 @@ public:
     void request_reschedule() { reschedule_requested = 2; }
 
 protected:
-    bool add_candidate(bool urgent = false);
+    bool add_candidates(bool urgent = false);
     void revalidate_current(int pos, const std::string &path);
     bool do_events();
     void reset();
 
+    // The transition context (handpicked/last) changed - rescore the pool
+    void request_rescore();
+    // Drop the winner that was picked ahead of time for the next slot
+    void invalidate_next() { next = -1; }
+
     // To be implemented in Imms
     virtual void reset_selection() = 0;
     virtual void request_playlist_item(int index) = 0;
     virtual void get_metacandidates(int size) = 0;
+    virtual void rescore_candidates(std::vector<SongData*> &data) = 0;
 
     SongData current;
     std::vector<int> metacandidates;
     int pl_length;
+    // Longest time since the last play that still counts towards a score
+    int local_max;
 
 private:
     void get_related(int pivot_sid, int limit);
+    void next_round();
+    bool rescore_stale(int limit);
+    int count_scored() const;
+    void sweep_playlist(int limit);
+
+    int add_positions(const std::vector<int> &positions);
+    void add_to_pool(const SongData &data);
+    void remove_from_pool(int position);
+    void classify(const SongData &data, time_t now);
+    void evict_weakest(int keep);
+    time_t elapsed(const SongData &data, time_t now) const;
+    int get_tickets(const SongData &data, time_t now);
+    void retally();
+    // Retally against the current time, then draw
+    int draw();
 
     bool selection_ready;
     int reschedule_requested;
     int acquired, attempts, playlist_known;
+    int context;
+    // The sweep makes one lap of the playlist from a random sweep_start;
+    // sweep_from is where it reads next, or -1 once the lap is done
+    int sweep_start, sweep_from;
+    bool sweep_wrapped;
+    // Position picked speculatively for the next slot, or -1
+    int next;
+    time_t max_elapsed;
     SongData winner;
 
-    typedef std::list<SongData> Candidates;
+    // Resident pool of candidates, keyed by playlist position. The sweep
+    // grows it over the effective playlist, up to a size that can all be
+    // rescored while a song plays; past that, each song added displaces
+    // the lowest rated. Only candidates scored for the current context
+    // hold tickets.
+    typedef std::map<int, SongData> Candidates;
     Candidates candidates;
+    // Pool positions played less than local_max ago, whose tickets still
+    // change as time passes, and the number of the others. tallied_cap
+    // is the local_max they were sorted by.
+    std::set<int> aging;
+    int capped, tallied_cap;
+    Lottery lottery;
+    // Stale candidates, the most relevant to the new context first
+    std::deque<int> rescore_queue;
 };
 
 #endif
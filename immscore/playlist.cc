@@ -17,6 +17,7 @@
  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
 */
 #include <iostream>
+#include <map>
 
 #include "playlist.h"
 #include "strmanip.h"
@@ -108,6 +109,32 @@ void PlaylistDb::playlist_insert_item(int pos, const string &path)
     WARNIFFAILED();
 }
 
+void PlaylistDb::playlist_queue_item(int pos, const string &path)
+{
+    pending_positions.push_back(pos);
+    pending_paths.push_back(path);
+}
+
+void PlaylistDb::playlist_flush()
+{
+    if (pending_positions.empty())
+        return;
+
+    try {
+        AutoTransaction a;
+        sql_insert_rows("INSERT OR REPLACE INTO Playlist "
+                "('pos', 'path', 'uid') VALUES",
+                "(?, ?, coalesce((SELECT uid FROM Identify "
+                    "WHERE path = ?), -1))",
+                pending_positions, pending_paths, pending_paths);
+        a.commit();
+    }
+    WARNIFFAILED();
+
+    pending_positions.clear();
+    pending_paths.clear();
+}
+
 int PlaylistDb::get_real_playlist_length()
 {
     int result = 0;
@@ -144,16 +171,62 @@ void PlaylistDb::get_random_sample(vector<int> &metacandidates, int size)
         Q q("SELECT pos FROM Filter "
                 "WHERE uid != -2 AND (abs(random()) % ?) < ?;");
         q << total << (size + 5);
+        q.fetch(-1, metacandidates);
+    }
+    WARNIFFAILED();
+}
 
-        int result;
-        while (q.next())
-        {
-            q >> result;
-            metacandidates.push_back(result);
+void PlaylistDb::get_filtered_positions(vector<int> &positions,
+        int from, int limit)
+{
+    try {
+        Q q("SELECT pos FROM Filter WHERE uid != -2 AND pos >= ? "
+                "ORDER BY pos LIMIT ?;");
+        q << from << limit;
+        q.fetch(limit, positions);
+    }
+    WARNIFFAILED();
+}
+
+void PlaylistDb::get_positions_of(const vector<int> &uids,
+        vector<int> &positions, int limit)
+{
+    static const int BatchSize = 32;
+    string query = "SELECT uid, pos FROM Filter WHERE uid != -2 AND uid IN ("
+        + sql_placeholders(BatchSize) + ");";
+
+    int found = 0;
+    for (size_t start = 0; start < uids.size() && found < limit;
+            start += BatchSize)
+    {
+        vector<int> got_uids, got_positions;
+        try {
+            Q q(query);
+            for (size_t i = start; i < start + BatchSize; ++i)
+                q << (i < uids.size() ? uids[i] : -2);
+
+            q.fetch(-1, got_uids, got_positions);
         }
+        WARNIFFAILED();
 
+        // Rows come back in table order; put them back in the order of
+        // uids, so that it is the last ones that the limit drops
+        std::multimap<int, int> by_uid;
+        for (size_t i = 0; i < got_uids.size(); ++i)
+            by_uid.insert(std::make_pair(got_uids[i], got_positions[i]));
+
+        size_t end = std::min(start + BatchSize, uids.size());
+        for (size_t i = start; i < end && found < limit; ++i)
+        {
+            std::pair<std::multimap<int, int>::iterator,
+                std::multimap<int, int>::iterator> range =
+                    by_uid.equal_range(uids[i]);
+            for (; range.first != range.second && found < limit;
+                    ++range.first, ++found)
+                positions.push_back(range.first->second);
+            by_uid.erase(uids[i]);
+        }
     }
-    WARNIFFAILED();
 }
 
 void PlaylistDb::clear_matches()
@@ -183,6 +256,9 @@ string PlaylistDb::get_item_from_playlist(int pos)
 
 void PlaylistDb::playlist_clear()
 {
+    pending_positions.clear();
+    pending_paths.clear();
+
     try {
         Q("DELETE FROM Playlist;").execute();
         Q("DELETE FROM Matches;").execute();
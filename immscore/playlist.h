@@ -31,6 +31,8 @@ public:
     PlaylistDb() : effective_length_cache(-1) { clear_matches(); }
     virtual ~PlaylistDb() {};
     void playlist_insert_item(int pos, const string &path);
+    // Items queued while a playlist loads are inserted in bulk when ready
+    void playlist_queue_item(int pos, const string &path);
     void playlist_update_identity(int pos, int uid);
     static Song playlist_id_from_item(int pos);
 
@@ -40,10 +42,16 @@ public:
     int get_real_playlist_length();
     int get_effective_playlist_length();
     void get_random_sample(std::vector<int> &metacandidates, int size);
+    void get_filtered_positions(std::vector<int> &positions,
+            int from, int limit);
+    // Positions of the given songs, taking uids in order until limit
+    void get_positions_of(const std::vector<int> &uids,
+            std::vector<int> &positions, int limit);
 
     void playlist_clear();
     void playlist_ready()
     {
+        playlist_flush();
         sync();
         playlist_updated();
     }
@@ -57,7 +65,11 @@ protected:
     virtual void sql_schema_upgrade(int) {}
 
 private:
+    void playlist_flush();
+
     int effective_length_cache;
+    std::vector<int> pending_positions;
+    std::vector<string> pending_paths;
 };
 
 #endif
@@ -0,0 +1,270 @@
+/*
+ IMMS: Intelligent Multimedia Management System
+ Copyright (C) 2001-2009 Michael Grigoriev
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+*/
+#include <math.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <functional>
+#include <iostream>
+#include <thread>
+
+#include "rebuild.h"
+#include "correlate.h"
+#include "flags.h"
+#include "immsutil.h"
+#include "sqlite++.h"
+
+using std::endl;
+using std::cerr;
+using std::vector;
+
+// Smallest change update_correlation bothers with
+#define MIN_UPDATE          0.25
+
+CorrelationRebuild::CorrelationRebuild(int threads) : threads(threads)
+{
+    if (this->threads <= 0)
+        this->threads = std::thread::hardware_concurrency();
+    this->threads = std::max(this->threads, 1);
+}
+
+uint64_t CorrelationRebuild::key(int sid1, int sid2)
+{
+    return ((uint64_t)std::min(sid1, sid2) << 32)
+        | (uint32_t)std::max(sid1, sid2);
+}
+
+void CorrelationRebuild::add(Sums &sums, int sid1, int sid2, float weight)
+{
+    if (fabs(weight) >= MIN_UPDATE)
+        sums[key(sid1, sid2)] += weight;
+}
+
+bool CorrelationRebuild::load_journal()
+{
+    journal.clear();
+    try {
+        Q q("SELECT Journal.time, Library.sid, Journal.played, Journal.flags "
+                "FROM Journal INNER JOIN Library "
+                "ON Journal.uid = Library.uid WHERE Library.sid > -1 "
+                "ORDER BY Journal.time ASC, Journal.rowid ASC;");
+
+        while (q.next())
+        {
+            Entry entry;
+            time_t played;
+            int flags;
+
+            q >> entry.time >> entry.sid >> played >> flags;
+            entry.weight = Flags::deltify(played, flags);
+            journal.push_back(entry);
+        }
+        return true;
+    }
+    WARNIFFAILED();
+    return false;
+}
+
+void CorrelationRebuild::replay(size_t begin, size_t end, Sums &sums,
+        vector<Update> &primary)
+{
+    for (size_t i = begin; i < end; ++i)
+    {
+        const Entry &from = journal[i];
+        if (from.weight == -1)
+            continue;
+
+        for (size_t j = i + 1; j < journal.size()
+                && journal[j].time - from.time <= CORRELATION_TIME; ++j)
+        {
+            const Entry &to = journal[j];
+            if (to.sid == from.sid || to.weight == -1)
+                continue;
+            if (from.weight < 0 && to.weight < 0)
+                continue;
+
+            float weight = sqrt(abs(from.weight * to.weight));
+            if (from.weight < 0 || to.weight < 0)
+                weight = -weight;
+
+            add(sums, from.sid, to.sid, weight);
+
+            // Only strong links are propagated
+            if (fabs(weight) >= 2)
+            {
+                Update update = { from.sid, to.sid, weight };
+                primary.push_back(update);
+            }
+        }
+    }
+}
+
+void CorrelationRebuild::propagate(const vector<Update> &primary, Sums &sums)
+{
+    static const vector<Neighbour> none;
+
+    for (size_t i = 0; i < primary.size(); ++i)
+    {
+        const Update &u = primary[i];
+
+        for (int end = 0; end < 2; ++end)
+        {
+            int node = end ? u.from : u.to;
+            int other = end ? u.to : u.from;
+            const vector<Neighbour> &edges =
+                node < (int)graph.size() ? graph[node] : none;
+
+            for (size_t k = 0; k < edges.size(); ++k)
+            {
+                const Neighbour &n = edges[k];
+                if (n.sid == other)
+                    continue;
+                if ((u.weight > 0 ? fabs(n.weight) : n.weight) <= 1)
+                    continue;
+
+                // node's neighbour becomes a neighbour of the other end
+                add(sums, other, n.sid,
+                        u.weight * n.weight * SECOND_DEGREE / MAX_CORRELATION);
+            }
+        }
+    }
+}
+
+static float clamp(float weight)
+{
+    return std::max(std::min(weight, (float)MAX_CORRELATION),
+            (float)-MAX_CORRELATION);
+}
+
+long CorrelationRebuild::run(const string &path)
+{
+    if (!SQLDatabaseConnection::threadsafe())
+    {
+        LOG(ERROR) << "SQLite was built without thread support" << endl;
+        return -1;
+    }
+
+    if (!load_journal())
+        return -1;
+
+    // Shard the journal by time; each worker also reads up to
+    // CORRELATION_TIME into the next shard
+    vector<Sums> sums(threads);
+    vector<vector<Update> > primary(threads);
+    {
+        vector<std::thread> workers;
+        for (int t = 0; t < threads; ++t)
+            workers.emplace_back(&CorrelationRebuild::replay, this,
+                    journal.size() * t / threads,
+                    journal.size() * (t + 1) / threads,
+                    std::ref(sums[t]), std::ref(primary[t]));
+        for (size_t t = 0; t < workers.size(); ++t)
+            workers[t].join();
+    }
+
+    Sums total;
+    for (int t = 0; t < threads; ++t)
+    {
+        for (Sums::iterator i = sums[t].begin(); i != sums[t].end(); ++i)
+            total[i->first] += i->second;
+        sums[t].clear();
+    }
+
+    graph.clear();
+    for (Sums::iterator i = total.begin(); i != total.end(); ++i)
+    {
+        int x = i->first >> 32, y = i->first & 0xffffffff;
+        float weight = clamp(i->second);
+
+        if ((int)graph.size() <= y)
+            graph.resize(y + 1);
+        Neighbour nx = { y, weight }, ny = { x, weight };
+        graph[x].push_back(nx);
+        graph[y].push_back(ny);
+    }
+
+    {
+        vector<std::thread> workers;
+        for (int t = 0; t < threads; ++t)
+            workers.emplace_back(&CorrelationRebuild::propagate, this,
+                    std::cref(primary[t]), std::ref(sums[t]));
+        for (size_t t = 0; t < workers.size(); ++t)
+            workers[t].join();
+    }
+
+    for (int t = 0; t < threads; ++t)
+        for (Sums::iterator i = sums[t].begin(); i != sums[t].end(); ++i)
+            total[i->first] += i->second;
+
+    if (!write(total, path))
+        return -1;
+    return total.size();
+}
+
+bool CorrelationRebuild::write(const Sums &sums, const string &path)
+{
+    // In key order, so the indices are built by appending
+    vector<std::pair<uint64_t, float> > edges(sums.begin(), sums.end());
+    std::sort(edges.begin(), edges.end());
+
+    string tmp = path + ".rebuild";
+    unlink(tmp.c_str());
+
+    bool ok = false;
+    try {
+        AttachedDatabase rebuilt(tmp, "R");
+        CorrelationDb::sql_create_correlations("R");
+
+        AutoTransaction a;
+        Q q("INSERT INTO R.Correlations ('x', 'y', 'weight') "
+                "VALUES (?, ?, ?);");
+
+        for (size_t i = 0; i < edges.size(); ++i)
+        {
+            q << int(edges[i].first >> 32) << int(edges[i].first & 0xffffffff)
+                << clamp(edges[i].second);
+            q.execute();
+        }
+
+        a.commit();
+        ok = true;
+    }
+    WARNIFFAILED();
+
+    if (!ok)
+    {
+        unlink(tmp.c_str());
+        return false;
+    }
+
+    // The log of the database being replaced must not be replayed into
+    // the new one
+    try {
+        Q("PRAGMA C.wal_checkpoint(TRUNCATE);").execute();
+    }
+    IGNOREFAILURE();
+
+    if (rename(tmp.c_str(), path.c_str()))
+    {
+        LOG(ERROR) << "failed to replace " << path << endl;
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,87 @@
+/*
+ IMMS: Intelligent Multimedia Management System
+ Copyright (C) 2001-2009 Michael Grigoriev
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+*/
+#ifndef __REBUILD_H
+#define __REBUILD_H
+
+#include <time.h>
+#include <stdint.h>
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+using std::string;
+
+// Recomputes C.Correlations from scratch by replaying the whole Journal,
+// for when the weights or the propagation rules change. Every entry is
+// correlated with those within CORRELATION_TIME after it; the journal is
+// cut into time shards that worker threads replay in parallel. Second
+// degree contributions are then spread through the resulting primary
+// graph, again in parallel, and the per-edge sums are merged, clamped,
+// and bulk loaded into a fresh database that replaces the old one.
+//
+// Unlike the daemon, contributions are summed before clamping, and
+// propagation sees the final primary graph rather than the graph as it
+// was at the time; the result is close to, but not identical with,
+// what live updates would have produced.
+class CorrelationRebuild
+{
+public:
+    // threads = 0 uses one per core
+    CorrelationRebuild(int threads = 0);
+
+    // Replace the database at path; returns the number of edges written,
+    // or -1 on failure. Nothing else may have the database open, immsd
+    // included: it would keep writing to the file that was replaced.
+    long run(const string &path);
+
+private:
+    struct Entry
+    {
+        time_t time;
+        int sid, weight;
+    };
+    struct Update
+    {
+        int from, to;
+        float weight;
+    };
+    struct Neighbour
+    {
+        int sid;
+        float weight;
+    };
+    typedef std::unordered_map<uint64_t, float> Sums;
+
+    static uint64_t key(int sid1, int sid2);
+    static void add(Sums &sums, int sid1, int sid2, float weight);
+
+    bool load_journal();
+    void replay(size_t begin, size_t end, Sums &sums,
+            std::vector<Update> &primary);
+    void propagate(const std::vector<Update> &primary, Sums &sums);
+    bool write(const Sums &sums, const string &path);
+
+    int threads;
+    std::vector<Entry> journal;
+    // The clamped primary graph, by sid
+    std::vector<std::vector<Neighbour> > graph;
+};
+
+#endif
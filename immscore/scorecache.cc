@@ -0,0 +1,283 @@
+/*
+ IMMS: Intelligent Multimedia Management System
+ Copyright (C) 2001-2009 Michael Grigoriev
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+*/
+#include <math.h>
+
+#include "scorecache.h"
+#include "sqlite++.h"
+
+using std::vector;
+
+ScoreCache::ScoreCache(size_t capacity, bool persistent)
+    : hits(0), misses(0), capacity(capacity), persistent(persistent),
+      dirty(false), cleared(false), acoustic_rowid(-1)
+{
+}
+
+ScoreCache::~ScoreCache()
+{
+}
+
+bool ScoreCache::lookup(int from, int to, float &score)
+{
+    Index::iterator i = index.find(make_key(from, to));
+    if (i == index.end())
+    {
+        ++misses;
+        return false;
+    }
+
+    ++hits;
+    touch(i->second);
+    score = i->second->score;
+    return true;
+}
+
+void ScoreCache::touch(Entries::iterator e)
+{
+    // Move to the front of the LRU list; the stored row is rewritten so
+    // that a reload keeps the same order
+    entries.splice(entries.begin(), entries, e);
+    e->changed = true;
+    dirty = true;
+}
+
+void ScoreCache::unindex(int uid, Entries::iterator e)
+{
+    std::pair<UidIndex::iterator, UidIndex::iterator> range =
+        by_uid.equal_range(uid);
+    for (UidIndex::iterator i = range.first; i != range.second; ++i)
+    {
+        if (i->second == e)
+        {
+            by_uid.erase(i);
+            return;
+        }
+    }
+}
+
+void ScoreCache::erase(Entries::iterator e)
+{
+    int from = key_from(e->key), to = key_to(e->key);
+    unindex(from, e);
+    if (to != from)
+        unindex(to, e);
+    index.erase(e->key);
+    entries.erase(e);
+}
+
+void ScoreCache::insert(int from, int to, float score)
+{
+    uint64_t key = make_key(from, to);
+
+    Index::iterator i = index.find(key);
+    if (i != index.end())
+    {
+        i->second->score = score;
+        touch(i->second);
+        return;
+    }
+
+    if (entries.size() >= capacity)
+    {
+        if (entries.back().stored)
+            evicted.push_back(entries.back().key);
+        erase(--entries.end());
+    }
+
+    Entry e = { key, score, false, true };
+    entries.push_front(e);
+    index[key] = entries.begin();
+    by_uid.insert(std::make_pair(from, entries.begin()));
+    if (to != from)
+        by_uid.insert(std::make_pair(to, entries.begin()));
+    dirty = true;
+}
+
+void ScoreCache::invalidate(int uid)
+{
+    // The stored rows are already gone: the Transitions_invalidate
+    // trigger removed them when the song's acoustic data was rewritten
+    std::pair<UidIndex::iterator, UidIndex::iterator> range =
+        by_uid.equal_range(uid);
+    std::vector<Entries::iterator> stale;
+    for (UidIndex::iterator i = range.first; i != range.second; ++i)
+        stale.push_back(i->second);
+
+    for (size_t i = 0; i < stale.size(); ++i)
+        erase(stale[i]);
+}
+
+void ScoreCache::clear()
+{
+    entries.clear();
+    index.clear();
+    by_uid.clear();
+    evicted.clear();
+    cleared = dirty = true;
+}
+
+void ScoreCache::refresh()
+{
+    try {
+        if (acoustic_rowid < 0)
+        {
+            Q q("SELECT IFNULL(max(rowid), 0) FROM A.Acoustic;");
+            if (!q.next())
+                return;
+            long rowid;
+            q >> rowid;
+            acoustic_rowid = rowid;
+            return;
+        }
+
+        // INSERT OR REPLACE gives a rewritten row a new rowid
+        Q q("SELECT rowid, uid FROM A.Acoustic WHERE rowid > ? "
+                "ORDER BY rowid;");
+        q << (long)acoustic_rowid;
+
+        while (q.next())
+        {
+            long rowid;
+            int uid;
+            q >> rowid >> uid;
+            invalidate(uid);
+            acoustic_rowid = rowid;
+        }
+    }
+    WARNIFFAILED();
+}
+
+void ScoreCache::sql_create_tables()
+{
+    RuntimeErrorBlocker reb;
+    try {
+        Q("CREATE TABLE A.Transitions ("
+                "'x' INTEGER NOT NULL, "
+                "'y' INTEGER NOT NULL, "
+                "'score' REAL NOT NULL);").execute();
+
+        Q("CREATE UNIQUE INDEX A.Transitions_x_y_i "
+                "ON Transitions (x, y);").execute();
+        Q("CREATE INDEX A.Transitions_y_i ON Transitions (y);").execute();
+
+        // Stale scores must not survive the analyzer rewriting a song,
+        // even if that happens while the daemon is not running
+        Q("CREATE TRIGGER A.Transitions_invalidate "
+                "AFTER INSERT ON Acoustic BEGIN "
+                "DELETE FROM Transitions "
+                    "WHERE x = NEW.uid OR y = NEW.uid; "
+                "END;").execute();
+    }
+    WARNIFFAILED();
+}
+
+void ScoreCache::load()
+{
+    refresh();
+
+    if (!persistent)
+        return;
+
+    // Rows are rewritten when used, so rowid order is LRU order: the
+    // newest rows are the ones to keep if there are more than fit
+    vector<long> rowids;
+    vector<int> xs, ys;
+    vector<float> scores;
+    try {
+        Q q("SELECT rowid, x, y, score FROM A.Transitions "
+                "ORDER BY rowid DESC LIMIT ?;");
+        q << (long)capacity;
+        q.fetch(-1, rowids, xs, ys, scores);
+
+        // Rows that did not fit would never be evicted
+        if (rowids.size() == capacity)
+        {
+            Q del("DELETE FROM A.Transitions WHERE rowid < ?;");
+            del << rowids.back();
+            del.execute();
+        }
+    }
+    WARNIFFAILED();
+
+    // Oldest first, so that the newest end up at the front
+    for (size_t i = rowids.size(); i-- > 0; )
+    {
+        insert(xs[i], ys[i], scores[i]);
+        entries.front().stored = true;
+        entries.front().changed = false;
+    }
+
+    dirty = false;
+}
+
+void ScoreCache::save()
+{
+    if (!persistent || !dirty)
+        return;
+
+    // Only rows that changed since the last save are written
+    vector<int> xs, ys;
+    vector<float> scores;
+    // Oldest first, so that a reload keeps the same LRU order
+    for (Entries::reverse_iterator i = entries.rbegin();
+            i != entries.rend(); ++i)
+    {
+        if (!i->changed || isnan(i->score))
+            continue;
+        xs.push_back(key_from(i->key));
+        ys.push_back(key_to(i->key));
+        scores.push_back(i->score);
+    }
+
+    bool saved = false;
+    try {
+        AutoTransaction a;
+
+        if (cleared)
+            Q("DELETE FROM A.Transitions;").execute();
+
+        Q del("DELETE FROM A.Transitions WHERE x = ? AND y = ?;");
+        for (size_t i = 0; i < evicted.size(); ++i)
+        {
+            del << key_from(evicted[i]) << key_to(evicted[i]);
+            del.execute();
+        }
+
+        // INSERT OR REPLACE moves a rewritten row to the end
+        sql_insert_rows("INSERT OR REPLACE INTO A.Transitions "
+                "('x', 'y', 'score') VALUES", "(?, ?, ?)", xs, ys, scores);
+
+        a.commit();
+        saved = true;
+    }
+    WARNIFFAILED();
+
+    if (!saved)
+        return;
+
+    for (Entries::iterator i = entries.begin(); i != entries.end(); ++i)
+    {
+        if (!i->changed || isnan(i->score))
+            continue;
+        i->stored = true;
+        i->changed = false;
+    }
+    evicted.clear();
+    cleared = dirty = false;
+}
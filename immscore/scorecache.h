@@ -0,0 +1,88 @@
+/*
+ IMMS: Intelligent Multimedia Management System
+ Copyright (C) 2001-2009 Michael Grigoriev
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+*/
+#ifndef __SCORECACHE_H
+#define __SCORECACHE_H
+
+#include <stdint.h>
+
+#include <list>
+#include <vector>
+#include <unordered_map>
+
+#include "immsconf.h"
+
+// Bounded LRU cache of acoustic transition scores, keyed by the
+// (from, to) pair of uids. A score of NAN means that one of the songs
+// has not been analyzed yet.
+class ScoreCache
+{
+public:
+    ScoreCache(size_t capacity, bool persistent);
+    ~ScoreCache();
+
+    bool lookup(int from, int to, float &score);
+    void insert(int from, int to, float score);
+
+    // Forget every transition from or to uid
+    void invalidate(int uid);
+    void clear();
+
+    // Pick up acoustic data rewritten since the last call
+    void refresh();
+
+    // Create/load/save A.Transitions - only used if persistent
+    static void sql_create_tables();
+    void load();
+    void save();
+
+    uint64_t hits, misses;
+    size_t size() const { return entries.size(); }
+private:
+    // stored: A.Transitions has a row for the entry;
+    // changed: that row is missing or older than the last use
+    struct Entry {
+        uint64_t key;
+        float score;
+        bool stored, changed;
+    };
+    typedef std::list<Entry> Entries;
+    typedef std::unordered_map<uint64_t, Entries::iterator> Index;
+    typedef std::unordered_multimap<int, Entries::iterator> UidIndex;
+
+    static uint64_t make_key(int from, int to)
+        { return ((uint64_t)(uint32_t)from << 32) | (uint32_t)to; }
+    static int key_from(uint64_t key) { return (int)(key >> 32); }
+    static int key_to(uint64_t key) { return (int)(uint32_t)key; }
+
+    void touch(Entries::iterator e);
+    void erase(Entries::iterator e);
+    void unindex(int uid, Entries::iterator e);
+
+    size_t capacity;
+    bool persistent, dirty, cleared;
+    int64_t acoustic_rowid;
+    Entries entries;
+    Index index;
+    // Every entry under both of its uids (once if they are the same)
+    UidIndex by_uid;
+    // Keys of stored entries evicted since the last save
+    std::vector<uint64_t> evicted;
+};
+
+#endif
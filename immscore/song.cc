@@ -24,6 +24,7 @@
 #include <unistd.h>
 
 #include <iostream>
+#include <sstream>
 
 #include "analyzer/beatkeeper.h"
 #include "analyzer/mfcckeeper.h"
@@ -145,8 +146,8 @@ void Song::set_acoustic(const MixtureModel &mm, const float *beats)
                 "('uid', 'mfcc', 'bpm') "
                 "VALUES (?, ?, ?);");
         q << uid;
-        q.bind(&mm.gauss, MFCCKeeper::ResultSize);
-        q.bind(beats, sizeof(float) * BEATSSIZE);
+        q.bind_static(&mm.gauss, MFCCKeeper::ResultSize);
+        q.bind_static(beats, sizeof(float) * BEATSSIZE);
         q.execute();
     }
     WARNIFFAILED();
@@ -530,6 +531,11 @@ void Song::infer_rating()
                     "VALUES (?, ?, ?);");
             q << uid << mean << trials;
             q.execute();
+
+            // The stored bias aggregate is out of date
+            Q d("DELETE FROM RatingStats WHERE uid = ?;");
+            d << uid;
+            d.execute();
         }
     } WARNIFFAILED();
 }
@@ -628,7 +634,81 @@ static float decay(float delta, float sum)
     return delta * log(DECAY_LIMIT + 1 - sum) / log(DECAY_LIMIT);
 }
 
-int Song::update_rating()
+void RatingStats::add(int delta)
+{
+    total += fabs(delta * DELTA_SCALE);
+
+    // Weightless entries never move the window
+    if (!delta)
+        return;
+
+    // Only the most recent DECAY_LIMIT worth of mass contributes
+    window.push_front(delta);
+
+    double mass = 0;
+    size_t keep = 0;
+    while (keep < window.size() && mass <= DECAY_LIMIT)
+        mass += fabs(window[keep++] * DELTA_SCALE);
+    window.resize(keep);
+}
+
+int RatingStats::rating() const
+{
+    double ones = 0, zeros = 0, mass = 0;
+
+    for (size_t i = 0; i < window.size(); ++i)
+    {
+        double delta = window[i] * DELTA_SCALE;
+        if (delta > 0)
+            ones += decay(delta, mass);
+        else
+            zeros += decay(-delta, mass);
+        mass += fabs(delta);
+    }
+
+    if (!ones && !zeros)
+        zeros = ones = 1;
+
+    if (total < MIN_TRIALS)
+    {
+        double biasmass = MIN_TRIALS - total;
+        ones += biasmass * biasmean;
+        zeros += biasmass * (1 - biasmean);
+    }
+
+    // Clamp off a minimum values to avoid rounding errors.
+    ones = std::max(ones, 0.0001);
+    zeros = std::max(zeros, 0.0001);
+
+    // Calculate the upper bound of the Wilson score. For details, see:
+    // http://www.evanmiller.org/how-not-to-sort-by-average-rating.html.
+    double n = ones + zeros;
+    double z = ltqnorm(0.95);
+    double phat = ones / n;
+    double r = phat + z*z/(2*n) + z * sqrt((phat*(1-phat)+z*z/(4*n))/n);
+    r /= (1+z*z/n);
+
+    return ROUND(r * 100);
+}
+
+string RatingStats::encode_window() const
+{
+    std::ostringstream out;
+    for (size_t i = 0; i < window.size(); ++i)
+        out << (i ? " " : "") << window[i];
+    return out.str();
+}
+
+void RatingStats::decode_window(const string &s)
+{
+    window.clear();
+    std::istringstream in(s);
+    int delta;
+    while (in >> delta)
+        window.push_back(delta);
+}
+
+int Song::update_rating(bool rescan)
 {
     int rating = -1;
     if (uid < 0)
@@ -636,61 +716,86 @@ int Song::update_rating()
 
     try
     {
-        float biasmean = 0.5, biastrials = 0;
+        RatingStats stats;
+
+        bool have = false;
+        if (!rescan)
         {
-            Q q("SELECT sum(mean * trials) / sum(trials), sum(trials) "
-                    "FROM Bias WHERE uid = ? GROUP BY uid;");
+            Q q("SELECT journal, total, window, biasmean, biastrials "
+                    "FROM RatingStats WHERE uid = ?;");
             q << uid;
 
-            if (q.next() && q.not_null())
+            if (q.next())
             {
-                q >> biasmean >> biastrials;
-                biasmean /= 100.0;
+                string window;
+                q >> stats.journal >> stats.total >> window
+                    >> stats.biasmean >> stats.biastrials;
+                stats.decode_window(window);
+                have = true;
             }
         }
 
-        Q q("SELECT played, flags FROM Journal WHERE uid = ? "
-                "ORDER BY time DESC;");
-        q << uid;
+        if (have)
+        {
+            // Plays are counted in time order. One recorded late, with
+            // an earlier time than a play already counted, means the
+            // window has to be rebuilt from the start.
+            Q q("SELECT count(*) FROM Journal "
+                    "WHERE uid = ? AND rowid > ? AND time < "
+                        "(SELECT max(time) FROM Journal "
+                            "WHERE uid = ? AND rowid <= ?);");
+            q << uid << stats.journal << uid << stats.journal;
+
+            int late = 0;
+            if (q.next())
+                q >> late;
 
-        double total = 0, ones = 0, zeros = 0;
+            if (late)
+            {
+                stats = RatingStats();
+                have = false;
+            }
+        }
 
-        while (q.next())
+        if (!have)
         {
-            int flags;
-            time_t played;
-            q >> played >> flags;
-            double delta = Flags::deltify(played, flags) * DELTA_SCALE;
-            if (delta > 0)
-                ones += decay(delta, total);
-            else
-                zeros += decay(-delta, total);
-            total += fabs(delta);
-        }
+            Q q("SELECT sum(mean * trials) / sum(trials), sum(trials) "
+                    "FROM Bias WHERE uid = ? GROUP BY uid;");
+            q << uid;
 
-        if (!ones && !zeros)
-            zeros = ones = 1;
+            if (q.next() && q.not_null())
+            {
+                q >> stats.biasmean >> stats.biastrials;
+                stats.biasmean /= 100.0;
+            }
+        }
 
-        if (total < MIN_TRIALS)
         {
-            double biasmass = MIN_TRIALS - total;
-            ones += biasmass * biasmean;
-            zeros += biasmass * (1 - biasmean);
-        }
+            Q q("SELECT rowid, played, flags FROM Journal "
+                    "WHERE uid = ? AND rowid > ? "
+                    "ORDER BY time ASC, rowid ASC;");
+            q << uid << stats.journal;
+
+            while (q.next())
+            {
+                long rowid;
+                int flags;
+                time_t played;
+                q >> rowid >> played >> flags;
 
-        // Clamp off a minimum values to avoid rounding errors.
-        ones = std::max(ones, 0.0001);
-        zeros = std::max(zeros, 0.0001);
+                stats.journal = std::max(stats.journal, rowid);
+                stats.add(Flags::deltify(played, flags));
+            }
+        }
 
-        // Calculate the upper bound of the Wilson score. For details, see:
-        // http://www.evanmiller.org/how-not-to-sort-by-average-rating.html.
-        double n = ones + zeros;
-        double z = ltqnorm(0.95);
-        double phat = ones / n;
-        double r = phat + z*z/(2*n) + z * sqrt((phat*(1-phat)+z*z/(4*n))/n);
-        r /= (1+z*z/n);
+        Q q("INSERT OR REPLACE INTO RatingStats "
+                "('uid', 'journal', 'total', 'window', "
+                "'biasmean', 'biastrials') VALUES (?, ?, ?, ?, ?, ?);");
+        q << uid << stats.journal << stats.total << stats.encode_window()
+            << stats.biasmean << stats.biastrials;
+        q.execute();
 
-        rating = ROUND(r * 100);
+        rating = stats.rating();
         set_rating(rating);
     }
     WARNIFFAILED();
@@ -21,6 +21,7 @@
 
 #include <utility>
 #include <string>
+#include <deque>
 
 using std::pair;
 using std::string;
@@ -29,6 +30,27 @@ typedef pair<string, string> StringPair;
 
 class MixtureModel;
 
+// What a song's rating is computed from: the mass of its whole journal
+// history, and its most recent deltas (newest first) for as long as
+// they still carry any weight. Journal entries up to the journal rowid
+// are accounted for.
+struct RatingStats
+{
+    RatingStats() : journal(0), total(0), biasmean(0.5), biastrials(0) {}
+
+    // Fold in a journal entry newer than all the others
+    void add(int delta);
+    int rating() const;
+
+    string encode_window() const;
+    void decode_window(const string &s);
+
+    long journal;
+    double total;
+    float biasmean, biastrials;
+    std::deque<int> window;
+};
+
 class Song
 {
 public:
@@ -56,7 +78,9 @@ public:
     void set_acoustic(const MixtureModel &mm, const float *beats);
     bool get_acoustic(MixtureModel *mm, float *beats) const;
 
-    int update_rating();
+    // Folds new journal entries into the stored rating statistics;
+    // rescan rebuilds them from the whole journal
+    int update_rating(bool rescan = false);
     void infer_rating();
 
     void reset() { playcounter = uid = sid = -1; artist = title = ""; }
@@ -18,6 +18,9 @@
 */
 #include <sqlite3.h>
 #include <sstream>
+#include <iomanip>
+#include <algorithm>
+#include <mutex>
 #include <time.h>
 
 #include <string.h>
@@ -38,25 +41,43 @@ public:
     
 protected:
     friend class SQLDatabaseConnection;
+    friend class AttachedDatabase;
 
     static void open(const string &filename);
     static void close();
+    static void set_journal_mode(const string &schema);
 
-    static sqlite3 *db_ptr;
+    static thread_local sqlite3 *db_ptr;
 };
 
 sqlite3* db() { return SQLDatabase::db(); }
 
-sqlite3 *SQLDatabase::db_ptr;
+thread_local sqlite3 *SQLDatabase::db_ptr;
 
 void SQLDatabase::open(const string &filename)
 {
     if (db_ptr)
         close();
-    if (sqlite3_open(filename.c_str(), &db_ptr))
+
+    // Each connection belongs to a single thread
+    int flags = SQLITE_OPEN_NOMUTEX | SQLITE_OPEN_READWRITE
+        | SQLITE_OPEN_CREATE;
+    if (sqlite3_open_v2(filename.c_str(), &db_ptr, flags, 0))
         throw SQLStandardException();
 
     sqlite3_busy_timeout(db(), 30000);
+    set_journal_mode("main");
+}
+
+void SQLDatabase::set_journal_mode(const string &schema)
+{
+    if (!SQLDatabaseConnection::use_wal)
+        return;
+
+    // Fails harmlessly where WAL is not available, eg. in memory
+    string query = "PRAGMA " + schema + ".journal_mode = WAL; "
+        "PRAGMA " + schema + ".synchronous = NORMAL;";
+    sqlite3_exec(db_ptr, query.c_str(), 0, 0, 0);
 }
 
 void SQLDatabase::close()
@@ -93,6 +114,8 @@ uint64_t SQLDatabaseConnection::last_rowid()
     return sqlite3_last_insert_rowid(SQLDatabase::db_ptr);
 }
 
+bool SQLDatabaseConnection::use_wal = true;
+
 SQLDatabaseConnection::SQLDatabaseConnection(const string &filename)
 {
     open(filename);
@@ -118,6 +141,11 @@ string SQLDatabaseConnection::error()
     return SQLDatabase::error();
 }
 
+bool SQLDatabaseConnection::threadsafe()
+{
+    return sqlite3_threadsafe() != 0;
+}
+
 // AttachedDatabase
 
 AttachedDatabase::AttachedDatabase(const string &filename, const string &alias)
@@ -136,6 +164,7 @@ void AttachedDatabase::attach(const string &filename, const string &alias)
         throw SQLException("Database already attached!");
     dbname = alias;
     Q("ATTACH \"" + filename + "\" AS " + dbname).execute();
+    SQLDatabase::set_journal_mode(dbname);
 }
 
 void AttachedDatabase::detach()
@@ -196,7 +225,7 @@ void AutoTransaction::commit()
 
 // SQLQueryManager
 
-SQLQueryManager *SQLQueryManager::instance;
+thread_local SQLQueryManager *SQLQueryManager::instance;
 
 sqlite3_stmt *SQLQueryManager::get(const string &query)
 {
@@ -222,6 +251,22 @@ sqlite3_stmt *SQLQueryManager::get(const string &query)
     return statement;
 }
 
+sqlite3_stmt *SQLQueryManager::get(const char *literal)
+{
+    LiteralMap::iterator i = literals.find(literal);
+
+    // A const char array on the stack also arrives here, and its address
+    // can later hold different text, so a hit is checked against the
+    // statement's own copy of the query
+    if (i != literals.end() && !strcmp(sqlite3_sql(i->second), literal))
+        return i->second;
+
+    sqlite3_stmt *statement = get(string(literal));
+    if (statement)
+        literals[literal] = statement;
+    return statement;
+}
+
 SQLQueryManager *SQLQueryManager::self()
 {
     if (!instance)
@@ -243,7 +288,8 @@ SQLQueryManager::~SQLQueryManager()
 
 // SQLQuery
 
-SQLQuery::SQLQuery(const string &query) : curbind(0), stmt(0)
+SQLQuery::SQLQuery(const string &query)
+    : curbind(0), stmt(0), stepped(false), elapsed(0), rows(0)
 {
     stmt = SQLQueryManager::self()->get(query);
 }
@@ -259,12 +305,33 @@ bool SQLQuery::next()
         return false;
 
     curbind = 0;
-    int r = sqlite3_step(stmt);
+    int r;
+    if (SQLProfiler::enabled())
+    {
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        r = sqlite3_step(stmt);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        stepped = true;
+        elapsed += (end.tv_sec - start.tv_sec) * 1000000000LL
+            + end.tv_nsec - start.tv_nsec;
+        if (r == SQLITE_ROW)
+            ++rows;
+    }
+    else
+        r = sqlite3_step(stmt);
+
     if (r == SQLITE_ROW)
         return true;
-    reset();
     if (r != SQLITE_DONE && r != SQLITE_CONSTRAINT)
-        throw SQLStandardException();
+    {
+        // Before the reset, which may run statements of its own
+        SQLException except = SQLStandardException();
+        reset();
+        throw except;
+    }
+    reset();
     return false;
 }
 
@@ -278,8 +345,15 @@ bool SQLQuery::is_null()
 void SQLQuery::reset()
 {
     curbind = 0;
-    if (stmt)
-        sqlite3_reset(stmt);
+    if (!stmt)
+        return;
+
+    sqlite3_reset(stmt);
+    if (stepped)
+        SQLProfiler::record(stmt, elapsed, rows);
+    stepped = false;
+    elapsed = 0;
+    rows = 0;
 }
 
 SQLQuery &SQLQuery::operator<<(int i)
@@ -332,6 +406,14 @@ SQLQuery &SQLQuery::bind(const void *data, size_t n)
     return *this;
 }
 
+SQLQuery &SQLQuery::bind_static(const void *data, size_t n)
+{
+    if (stmt)
+        if (sqlite3_bind_blob(stmt, ++curbind, data, n, SQLITE_STATIC))
+            throw SQLStandardException();
+    return *this;
+}
+
 SQLQuery &SQLQuery::operator<<(const SQLExec &)
 {
     this->execute();
@@ -369,6 +451,18 @@ SQLQuery &SQLQuery::operator>>(string &s)
     return *this;
 }
 
+SQLQuery &SQLQuery::operator>>(const char *&s)
+{
+    s = "";
+    if (stmt)
+    {
+        const char *c = (const char *)sqlite3_column_text(stmt, curbind++);
+        if (c)
+            s = c;
+    }
+    return *this;
+}
+
 SQLQuery &SQLQuery::operator>>(double &i)
 {
     if (stmt)
@@ -391,6 +485,19 @@ SQLQuery &SQLQuery::load(void *data, size_t &n)
     return *this;
 }
 
+SQLQuery &SQLQuery::view(const void *&data, size_t &n)
+{
+    data = 0;
+    n = 0;
+    if (stmt)
+    {
+        // The size is only meaningful once the value has been fetched
+        data = sqlite3_column_blob(stmt, curbind);
+        n = sqlite3_column_bytes(stmt, curbind++);
+    }
+    return *this;
+}
+
 SQLQuery &SQLQuery::operator>>(float &i)
 {
     double j = 0;
@@ -398,3 +505,172 @@ SQLQuery &SQLQuery::operator>>(float &i)
     i = j;
     return *this;
 }
+
+// SQLProfiler
+
+std::atomic<bool> SQLProfiler::active(false);
+
+struct StatementProfile
+{
+    StatementProfile() : calls(0), rows(0), fullscans(0), sorts(0),
+        nsec(0), next(0) {}
+
+    long calls, rows, fullscans, sorts;
+    uint64_t nsec;
+    // Times of the last ProfileSamples runs, for the percentiles
+    std::vector<uint64_t> recent;
+    size_t next;
+    string plan;
+};
+
+static const size_t ProfileSamples = 1000;
+
+static std::mutex profile_mutex;
+static std::unordered_map<string, StatementProfile> profiles;
+
+static string query_plan(sqlite3 *db, const char *sql)
+{
+    string plan;
+    sqlite3_stmt *explain = 0;
+
+    if (!sqlite3_prepare_v2(db,
+                (string("EXPLAIN QUERY PLAN ") + sql).c_str(), -1,
+                &explain, 0))
+    {
+        while (sqlite3_step(explain) == SQLITE_ROW)
+        {
+            const char *detail = (const char *)sqlite3_column_text(explain, 3);
+            if (detail)
+                plan += (plan.empty() ? "" : "; ") + string(detail);
+        }
+    }
+    sqlite3_finalize(explain);
+
+    return plan;
+}
+
+void SQLProfiler::record(sqlite3_stmt *stmt, uint64_t nsec,
+        long rows) noexcept
+{
+    // This runs from ~SQLQuery, possibly while an exception unwinds the
+    // stack: nothing may escape
+    try {
+        record_run(stmt, nsec, rows);
+    }
+    catch (...) {}
+}
+
+void SQLProfiler::record_run(sqlite3_stmt *stmt, uint64_t nsec, long rows)
+{
+    const char *sql = sqlite3_sql(stmt);
+    if (!sql)
+        return;
+
+    int fullscans = sqlite3_stmt_status(stmt,
+            SQLITE_STMTSTATUS_FULLSCAN_STEP, 1);
+    int sorts = sqlite3_stmt_status(stmt, SQLITE_STMTSTATUS_SORT, 1);
+
+    bool first;
+    {
+        std::lock_guard<std::mutex> lock(profile_mutex);
+        StatementProfile &p = profiles[sql];
+        first = !p.calls;
+
+        ++p.calls;
+        p.rows += rows;
+        p.fullscans += fullscans;
+        p.sorts += sorts;
+        p.nsec += nsec;
+
+        if (p.recent.size() < ProfileSamples)
+            p.recent.push_back(nsec);
+        else
+            p.recent[p.next] = nsec;
+        p.next = (p.next + 1) % ProfileSamples;
+    }
+
+    if (!first)
+        return;
+
+    string plan = query_plan(sqlite3_db_handle(stmt), sql);
+    std::lock_guard<std::mutex> lock(profile_mutex);
+    profiles[sql].plan = plan;
+}
+
+static bool more_time(const std::pair<string, StatementProfile> &x,
+        const std::pair<string, StatementProfile> &y)
+{
+    return x.second.nsec > y.second.nsec;
+}
+
+void SQLProfiler::report(std::ostream &out)
+{
+    std::vector<std::pair<string, StatementProfile> > sorted;
+    {
+        std::lock_guard<std::mutex> lock(profile_mutex);
+        sorted.assign(profiles.begin(), profiles.end());
+    }
+    std::sort(sorted.begin(), sorted.end(), more_time);
+
+    using std::setw;
+    out << setw(9) << "calls" << setw(11) << "total ms" << setw(10)
+        << "avg us" << setw(10) << "p99 us" << setw(10) << "rows"
+        << setw(10) << "fullscan" << setw(8) << "sorts" << "  statement"
+        << endl;
+
+    for (size_t i = 0; i < sorted.size(); ++i)
+    {
+        const StatementProfile &p = sorted[i].second;
+
+        std::vector<uint64_t> recent = p.recent;
+        std::sort(recent.begin(), recent.end());
+        uint64_t p99 = recent.empty() ? 0
+            : recent[std::min(recent.size() - 1, recent.size() * 99 / 100)];
+
+        out << std::fixed << std::setprecision(1)
+            << setw(9) << p.calls
+            << setw(11) << p.nsec / 1e6
+            << setw(10) << p.nsec / 1e3 / std::max(p.calls, 1L)
+            << setw(10) << p99 / 1e3
+            << setw(10) << p.rows
+            << setw(10) << p.fullscans
+            << setw(8) << p.sorts
+            << "  " << sorted[i].first << endl;
+        if (!p.plan.empty())
+            out << string(70, ' ') << "plan: " << p.plan << endl;
+    }
+}
+
+void SQLProfiler::clear()
+{
+    std::lock_guard<std::mutex> lock(profile_mutex);
+    profiles.clear();
+}
+
+string sql_placeholders(int n)
+{
+    string result;
+    for (int i = 0; i < n; ++i)
+        result += i ? ", ?" : "?";
+    return result;
+}
+
+string sql_rows(const string &head, const string &row, int n)
+{
+    string result = head;
+    for (int i = 0; i < n; ++i)
+        result += (i ? ", " : " ") + row;
+    return result + ";";
+}
+
+int sql_batch_size(size_t remaining, int params)
+{
+    // Stay well under SQLITE_MAX_VARIABLE_NUMBER (999 by default)
+    static const int MaxRows = 64, MaxParams = 999;
+
+    int batch = 1;
+    while (batch * 2 <= MaxRows && batch * 2 * params <= MaxParams
+            && (size_t)batch * 2 <= remaining)
+        batch *= 2;
+    return batch;
+}
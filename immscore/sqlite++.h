@@ -22,7 +22,9 @@
 #include "immsconf.h"
 #include <string>
 #include <iostream>
-#include <map>
+#include <unordered_map>
+#include <vector>
+#include <atomic>
 #include <stdint.h>
 
 using std::string;
@@ -32,6 +34,13 @@ using std::endl;
 class SQLExec {};
 extern SQLExec execute;
 
+// Every thread has a connection of its own, along with its own cache
+// of prepared statements; a thread opens its connection before making
+// any queries. Connections are never shared, so threads need no locking
+// of their own, and each waits for other writers on its own.
+//
+// Databases are put in write-ahead log mode, which lets readers go on
+// while another connection or process writes.
 class SQLDatabaseConnection
 {
 public:
@@ -44,6 +53,13 @@ public:
     void open(const string &filename);
     void close();
     static string error();
+
+    // False if SQLite was built without thread support; a process that
+    // uses it from more than one thread checks this first
+    static bool threadsafe();
+
+    // Journal mode for databases opened or attached from now on
+    static bool use_wal;
 };
 
 class AttachedDatabase
@@ -89,17 +105,45 @@ class SQLQueryManager
 public:
     SQLQueryManager() : block_errors(false) {}
     sqlite3_stmt *get(const string &query);
+    // A string literal is looked up by its address, falling back on the
+    // text if the statement cached there is for a different query
+    sqlite3_stmt *get(const char *literal);
     ~SQLQueryManager();
 
     static SQLQueryManager *self();
     static void kill();
 private:
-    typedef std::map<string, sqlite3_stmt *> StmtMap;
+    typedef std::unordered_map<string, sqlite3_stmt *> StmtMap;
+    typedef std::unordered_map<const char *, sqlite3_stmt *> LiteralMap;
     StmtMap statements;
+    LiteralMap literals;
 
     friend class RuntimeErrorBlocker;
     bool block_errors;
-    static SQLQueryManager *instance;
+    static thread_local SQLQueryManager *instance;
+};
+
+// Opt-in accounting of where the database time goes. Each run of a
+// statement is timed and the rows it returned, and the full scan and
+// sort steps it took, are counted; the first run also captures its
+// query plan. Statements are told apart by their text.
+class SQLProfiler
+{
+public:
+    static void enable(bool on = true) { active = on; }
+    static bool enabled() { return active; }
+
+    // One entry per statement, the most time consuming first
+    static void report(std::ostream &out);
+    static void clear();
+
+private:
+    friend class SQLQuery;
+    static void record(sqlite3_stmt *stmt, uint64_t nsec,
+            long rows) noexcept;
+    static void record_run(sqlite3_stmt *stmt, uint64_t nsec, long rows);
+
+    static std::atomic<bool> active;
 };
 
 class RuntimeErrorBlocker
@@ -117,6 +161,14 @@ class SQLQuery
 {
 public:
     SQLQuery(const string &query);
+    // Queries written out in full are found without touching their text
+    template <size_t N> SQLQuery(const char (&query)[N])
+        : curbind(0), stmt(SQLQueryManager::self()->get(query)),
+          stepped(false), elapsed(0), rows(0) {}
+    // The contents of a buffer may change
+    template <size_t N> SQLQuery(char (&query)[N])
+        : curbind(0), stmt(SQLQueryManager::self()->get(string(query))),
+          stepped(false), elapsed(0), rows(0) {}
     ~SQLQuery();
 
     void reset();
@@ -134,27 +186,100 @@ public:
     SQLQuery &operator<<(const SQLExec &execute);
 
     SQLQuery &bind(const void *data, size_t n);
+    // As bind, but without copying: data must stay put until the
+    // query has been executed
+    SQLQuery &bind_static(const void *data, size_t n);
 
     SQLQuery &operator>>(int &i);
     SQLQuery &operator>>(long &i);
     SQLQuery &operator>>(double &i);
     SQLQuery &operator>>(float &i);
     SQLQuery &operator>>(string &s);
+    // No copy is made: the text is only valid until the next step or reset
+    SQLQuery &operator>>(const char *&s);
 
     SQLQuery &load(void *data, size_t &n);
+    // Points at a BLOB instead of copying it: valid until the next step
+    SQLQuery &view(const void *&data, size_t &n);
     SQLQuery &load(void *data, unsigned long long n) {
         size_t real_size = n;
         return load(data, real_size);
     };
 
+    // Append up to limit rows, one vector per column; returns the number
+    // of rows read. Fewer than limit means the rows have run out, and the
+    // query has been reset.
+    template <typename... T>
+    size_t fetch(size_t limit, std::vector<T> &... columns)
+    {
+        size_t rows = 0;
+        while (rows < limit && next())
+        {
+            append(columns...);
+            ++rows;
+        }
+        return rows;
+    }
+
 private:
+    void append() {}
+    template <typename T, typename... Rest>
+    void append(std::vector<T> &column, std::vector<Rest> &... rest)
+    {
+        column.push_back(T());
+        *this >> column.back();
+        append(rest...);
+    }
+
     int curbind;
 
     sqlite3_stmt *stmt;
+
+    // For the profiler: the current run of the statement so far
+    bool stepped;
+    uint64_t elapsed;
+    long rows;
 };
 
 typedef SQLQuery Q;
 
+// "?, ?, ..., ?" - for binding a fixed number of values into an IN () list
+string sql_placeholders(int n);
+
+// "head row, row, ..., row;" - the statement for a batch of n rows
+string sql_rows(const string &head, const string &row, int n);
+// Rows to insert with the next statement: a power of two, so that only a
+// handful of distinct batch statements are ever prepared
+int sql_batch_size(size_t remaining, int params);
+
+inline void sql_bind_row(SQLQuery &, size_t) {}
+
+template <typename T, typename... Rest>
+void sql_bind_row(SQLQuery &q, size_t i, const std::vector<T> &column,
+        const std::vector<Rest> &... rest)
+{
+    q << column[i];
+    sql_bind_row(q, i, rest...);
+}
+
+// Insert one row per element of the columns, binding the i'th element of
+// each column, in order, into the placeholders of the i'th copy of row:
+//   sql_insert_rows("INSERT INTO T (a, b) VALUES", "(?, ?)", as, bs);
+// A column may be passed more than once if row uses it more than once.
+template <typename T, typename... Rest>
+void sql_insert_rows(const string &head, const string &row,
+        const std::vector<T> &first, const std::vector<Rest> &... rest)
+{
+    for (size_t done = 0; done < first.size(); )
+    {
+        int batch = sql_batch_size(first.size() - done, 1 + sizeof...(Rest));
+        Q q(sql_rows(head, row, batch));
+        for (int i = 0; i < batch; ++i)
+            sql_bind_row(q, done++, first, rest...);
+        q.execute();
+    }
+}
+
 #define WARNIFFAILED()                                                      \
     catch (SQLException &e) {                                               \
         cerr << string(80, '*') << endl;                                    \
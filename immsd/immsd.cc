@@ -23,6 +23,7 @@
 #include <unistd.h>
 
 #include <iostream>
+#include <fstream>
 #include <sstream>
 #include <list>
 
@@ -43,9 +44,33 @@ const string AppName = IMMSD_APP;
 
 static Imms *imms;
 static list<RemoteProcessor*> remotes;
+static volatile sig_atomic_t profile_requested = 0;
+
+// The first request turns the profiler on; later ones get a report
+static void dump_profile()
+{
+    string path = get_imms_root("imms.profile");
+    {
+        std::ofstream out((path + ".tmp").c_str());
+        if (SQLProfiler::enabled())
+            SQLProfiler::report(out);
+        else
+        {
+            SQLProfiler::enable();
+            out << "SQL profiling is now on - "
+                "ask again later for a report." << endl;
+        }
+    }
+    rename((path + ".tmp").c_str(), path.c_str());
+}
 
 gboolean do_events(void *)
 {
+    if (profile_requested)
+    {
+        profile_requested = 0;
+        dump_profile();
+    }
     if (imms)
         imms->do_events();
     return TRUE;
@@ -209,7 +234,7 @@ void ImmsProcessor::process_line(const string &line)
         string path;
         getline(sstr, path);
         path = path_normalize(path);
-        imms->playlist_insert_item(pos, path);
+        imms->playlist_queue_item(pos, path);
         return;
     }
     if (command == "PlaylistEnd")
@@ -252,6 +277,11 @@ void quit(int signum)
     signal(signum, SIG_DFL);
 }
 
+void request_profile(int)
+{
+    profile_requested = 1;
+}
+
 int main()
 {
     int r = mkdir(get_imms_root().c_str(), 0700);
@@ -273,12 +303,23 @@ int main()
     for (int i = 3; i < 255; ++i)
         close(i);
 
+    // Plays are written to the journal from a thread of their own
+    if (!SQLDatabaseConnection::threadsafe())
+    {
+        LOG(ERROR) << "SQLite was built without thread support - exiting."
+            << endl;
+        exit(1);
+    }
+
+    SQLProfiler::enable(get_config("profile_sql", 0));
+
     loop = g_main_loop_new(NULL, FALSE);
 
     signal(SIGINT,  quit);
     signal(SIGTERM, quit);
     //signal(SIGPIPE, SIG_IGN);
     signal(SIGPIPE, quit);
+    signal(SIGUSR1, request_profile);
 
     GSource* ts = g_timeout_source_new(500);
     g_source_attach(ts, NULL);
@@ -0,0 +1,542 @@
+/*
+ IMMS: Intelligent Multimedia Management System
+ Copyright (C) 2001-2009 Michael Grigoriev
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+*/
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <functional>
+
+#include <sqlite++.h>
+
+#include "acousticindex.h"
+
+using std::endl;
+using std::string;
+using std::vector;
+
+// Points per leaf; leaves split once they grow to twice this
+static const size_t LeafSize = 16;
+
+static const char Magic[8] = { 'I', 'M', 'M', 'S', 'A', 'N', 'N', '1' };
+
+AcousticIndex::AcousticIndex()
+    : live(0), built(0), acoustic_rowid(0), seed(1), dirty(false)
+{
+}
+
+void AcousticIndex::embed(const AcousticView &view, float out[Dims])
+{
+    static const int NumDims = Gaussian::NumDimensions;
+    static const int comb = 5;
+    static const int OUTSIZE = DIVROUNDUP(BEATSSIZE, comb);
+    // Same floor as the KL divergence uses
+    const float MinVariance = 10.0f;
+    // So that the beat graph counts about as much as the cepstrum
+    const float BeatScale = 4.0f;
+
+    // The mean and variance of the mixture as a whole: the KL
+    // divergence grows with (m1 - m2)^2 / var and log(var1 / var2)^2
+    for (int d = 0; d < NumDims; ++d)
+    {
+        double mean = 0, second = 0;
+        for (int g = 0; g < NUMGAUSS; ++g)
+        {
+            double w = view.weight(g), m = view.mean(g)[d];
+            mean += w * m;
+            second += w * (view.var(g)[d] + m * m);
+        }
+        double var = std::max(second - mean * mean, (double)MinVariance);
+
+        out[d] = mean / sqrt(var);
+        out[NumDims + d] = log(var);
+    }
+
+    // Cumulative beat histogram: the 1-D EMD is the L1 distance
+    // between these
+    float *cdf = out + 2 * NumDims;
+    memset(cdf, 0, sizeof(float) * OUTSIZE);
+
+    float sum = 0;
+    for (int i = 0; i < BEATSSIZE; ++i)
+        sum += view.beats[i];
+    if (sum == 0)
+        return;
+
+    for (int i = 0; i < BEATSSIZE; ++i)
+        cdf[i / comb] += view.beats[i] / sum;
+    for (int i = 1; i < OUTSIZE; ++i)
+        cdf[i] += cdf[i - 1];
+    for (int i = 0; i < OUTSIZE; ++i)
+        cdf[i] *= BeatScale;
+}
+
+float AcousticIndex::distance(const float *a, const float *b) const
+{
+    // Four independent sums, so the additions can overlap
+    float sums[4] = { 0, 0, 0, 0 };
+    int i = 0;
+    for (; i + 4 <= Dims; i += 4)
+        for (int j = 0; j < 4; ++j)
+        {
+            float d = a[i + j] - b[i + j];
+            sums[j] += d * d;
+        }
+    for (; i < Dims; ++i)
+    {
+        float d = a[i] - b[i];
+        sums[0] += d * d;
+    }
+    return sqrtf((sums[0] + sums[1]) + (sums[2] + sums[3]));
+}
+
+void AcousticIndex::build(const FeatureStore &store)
+{
+    points.clear();
+    point_uids.clear();
+    uid_points.clear();
+    nodes.clear();
+    live = built = 0;
+    acoustic_rowid = 0;
+
+    refresh(store);
+    rebuild();
+}
+
+int AcousticIndex::refresh(const FeatureStore &store)
+{
+    int updated = 0;
+
+    try {
+        Q q("SELECT rowid, uid FROM A.Acoustic "
+                "WHERE rowid > ? AND mfcc NOTNULL AND bpm NOTNULL "
+                "ORDER BY rowid;");
+        q << (long)acoustic_rowid;
+
+        while (q.next())
+        {
+            long rowid;
+            int uid;
+            q >> rowid >> uid;
+
+            // Wait for the store to catch up
+            AcousticView view;
+            if (!store.find(uid, view))
+                break;
+
+            insert(uid, view);
+            acoustic_rowid = rowid;
+            ++updated;
+        }
+    }
+    WARNIFFAILED();
+
+    return updated;
+}
+
+int AcousticIndex::add_point(int uid, const AcousticView &view)
+{
+    int p = point_uids.size();
+    points.resize(points.size() + Dims);
+    embed(view, &points[p * Dims]);
+    point_uids.push_back(uid);
+
+    if (uid >= (int)uid_points.size())
+        uid_points.resize(uid + 1, -1);
+    uid_points[uid] = p;
+    ++live;
+
+    return p;
+}
+
+void AcousticIndex::insert(int uid, const AcousticView &view)
+{
+    if (uid < 0)
+        return;
+
+    remove(uid);
+    route(add_point(uid, view));
+    dirty = true;
+
+    // Inserted points land wherever the old splits send them, so the
+    // tree is rebuilt whenever it has doubled in size
+    if (point_uids.size() > 2 * built + LeafSize)
+        rebuild();
+}
+
+void AcousticIndex::remove(int uid)
+{
+    if (uid < 0 || uid >= (int)uid_points.size() || uid_points[uid] < 0)
+        return;
+
+    // Removed points stay in the tree until the next rebuild
+    point_uids[uid_points[uid]] = -1;
+    uid_points[uid] = -1;
+    --live;
+    dirty = true;
+
+    if (point_uids.size() - live > live / 2 + LeafSize)
+        rebuild();
+}
+
+void AcousticIndex::rebuild()
+{
+    vector<float> old_points;
+    vector<int> old_uids;
+    old_points.swap(points);
+    old_uids.swap(point_uids);
+
+    uid_points.assign(uid_points.size(), -1);
+    points.reserve(live * Dims);
+    point_uids.reserve(live);
+
+    for (size_t p = 0; p < old_uids.size(); ++p)
+    {
+        if (old_uids[p] < 0)
+            continue;
+        uid_points[old_uids[p]] = point_uids.size();
+        point_uids.push_back(old_uids[p]);
+        points.insert(points.end(), old_points.begin() + p * Dims,
+                old_points.begin() + (p + 1) * Dims);
+    }
+
+    vector<int> all(point_uids.size());
+    for (size_t p = 0; p < all.size(); ++p)
+        all[p] = p;
+
+    nodes.assign(1, Node());
+    make(0, all.begin(), all.end());
+
+    built = live = point_uids.size();
+    dirty = true;
+}
+
+void AcousticIndex::make(int node, vector<int>::iterator begin,
+        vector<int>::iterator end)
+{
+    size_t n = end - begin;
+    if (n <= LeafSize)
+    {
+        nodes[node].vp = -1;
+        nodes[node].bucket.assign(begin, end);
+        return;
+    }
+
+    // Pick a random vantage point and split the rest at the median
+    // distance from it
+    seed = seed * 1103515245 + 12345;
+    std::iter_swap(begin, begin + (seed >> 8) % n);
+    int vp = *begin;
+
+    vector<Candidate> dists(n - 1);
+    for (size_t i = 0; i < n - 1; ++i)
+    {
+        dists[i].point = begin[i + 1];
+        dists[i].dist = distance(point(vp), point(dists[i].point));
+    }
+
+    size_t median = (n - 1) / 2;
+    std::nth_element(dists.begin(), dists.begin() + median, dists.end());
+    for (size_t i = 0; i < n - 1; ++i)
+        begin[i + 1] = dists[i].point;
+
+    int inside = nodes.size();
+    int outside = inside + 1;
+    nodes.resize(nodes.size() + 2);
+
+    Node &split = nodes[node];
+    split.vp = vp;
+    split.radius = dists[median].dist;
+    split.inside = inside;
+    split.outside = outside;
+    split.bucket.clear();
+
+    make(inside, begin + 1, begin + 2 + median);
+    make(outside, begin + 2 + median, end);
+}
+
+void AcousticIndex::route(int p)
+{
+    if (nodes.empty())
+        nodes.push_back(Node());
+
+    int node = 0;
+    while (nodes[node].vp >= 0)
+    {
+        const Node &split = nodes[node];
+        node = distance(point(p), point(split.vp)) <= split.radius ?
+            split.inside : split.outside;
+    }
+
+    nodes[node].bucket.push_back(p);
+    if (nodes[node].bucket.size() >= 2 * LeafSize)
+    {
+        vector<int> bucket;
+        bucket.swap(nodes[node].bucket);
+        make(node, bucket.begin(), bucket.end());
+    }
+}
+
+void AcousticIndex::consider(int p, float dist, size_t k, int exclude,
+        vector<Candidate> &heap) const
+{
+    if (point_uids[p] < 0 || point_uids[p] == exclude)
+        return;
+
+    Candidate c = { dist, p };
+    if (heap.size() < k)
+    {
+        heap.push_back(c);
+        std::push_heap(heap.begin(), heap.end());
+    }
+    else if (dist < heap.front().dist)
+    {
+        std::pop_heap(heap.begin(), heap.end());
+        heap.back() = c;
+        std::push_heap(heap.begin(), heap.end());
+    }
+}
+
+void AcousticIndex::search(const float *query, size_t k, int exclude,
+        size_t max_checks, vector<Candidate> &heap) const
+{
+    // Best first: subtrees are visited in order of how close they could
+    // possibly be. Everything inside is within radius of the vantage
+    // point and everything outside at least that far, which by the
+    // triangle inequality bounds the distance to any of them.
+    vector<Candidate> queue;
+    Candidate root = { 0, 0 };
+    queue.push_back(root);
+
+    size_t checks = 0;
+    while (!queue.empty())
+    {
+        std::pop_heap(queue.begin(), queue.end(), std::greater<Candidate>());
+        Candidate next = queue.back();
+        queue.pop_back();
+
+        float tau = heap.size() < k ? INFINITY : heap.front().dist;
+        if (next.dist > tau)
+            break;
+        if (max_checks && checks >= max_checks && heap.size() >= k)
+            break;
+
+        const Node &n = nodes[next.point];
+        if (n.vp < 0)
+        {
+            for (size_t i = 0; i < n.bucket.size(); ++i)
+                consider(n.bucket[i], distance(query, point(n.bucket[i])),
+                        k, exclude, heap);
+            checks += n.bucket.size();
+            continue;
+        }
+
+        float d = distance(query, point(n.vp));
+        consider(n.vp, d, k, exclude, heap);
+        ++checks;
+
+        Candidate inside = { std::max(d - n.radius, next.dist), n.inside };
+        Candidate outside = { std::max(n.radius - d, next.dist), n.outside };
+        queue.push_back(inside);
+        std::push_heap(queue.begin(), queue.end(), std::greater<Candidate>());
+        queue.push_back(outside);
+        std::push_heap(queue.begin(), queue.end(), std::greater<Candidate>());
+    }
+}
+
+void AcousticIndex::nearest(const AcousticView &view, size_t k,
+        vector<int> &uids, int exclude, size_t max_checks) const
+{
+    uids.clear();
+    if (nodes.empty() || !k)
+        return;
+
+    float query[Dims];
+    embed(view, query);
+
+    vector<Candidate> heap;
+    heap.reserve(k);
+    search(query, k, exclude, max_checks, heap);
+
+    std::sort_heap(heap.begin(), heap.end());
+    for (size_t i = 0; i < heap.size(); ++i)
+        uids.push_back(point_uids[heap[i].point]);
+}
+
+template <typename T>
+static bool write_array(FILE *f, const T *data, size_t n)
+{
+    return fwrite(data, sizeof(T), n, f) == n;
+}
+
+template <typename T>
+static bool read_array(FILE *f, T *data, size_t n)
+{
+    return fread(data, sizeof(T), n, f) == n;
+}
+
+bool AcousticIndex::save(const string &filename)
+{
+    if (!dirty)
+        return true;
+
+    // Write to the side and rename, so that a crash can't leave
+    // half an index behind
+    string tmpname = filename + ".tmp";
+    FILE *f = fopen(tmpname.c_str(), "w");
+    if (!f)
+        return false;
+
+    int32_t dims = Dims;
+    int64_t rowid = acoustic_rowid;
+    uint64_t counts[3] = { point_uids.size(), built, nodes.size() };
+
+    bool ok = write_array(f, Magic, sizeof(Magic))
+        && write_array(f, &dims, 1)
+        && write_array(f, &rowid, 1)
+        && write_array(f, &seed, 1)
+        && write_array(f, counts, 3)
+        && write_array(f, points.data(), points.size())
+        && write_array(f, point_uids.data(), point_uids.size());
+
+    for (size_t i = 0; ok && i < nodes.size(); ++i)
+    {
+        const Node &n = nodes[i];
+        int32_t links[3] = { n.vp, n.inside, n.outside };
+        uint32_t size = n.bucket.size();
+        ok = write_array(f, links, 3)
+            && write_array(f, &n.radius, 1)
+            && write_array(f, &size, 1)
+            && write_array(f, n.bucket.data(), size);
+    }
+
+    ok = !fclose(f) && ok;
+    if (ok)
+        ok = !rename(tmpname.c_str(), filename.c_str());
+    if (!ok)
+    {
+        unlink(tmpname.c_str());
+        LOG(ERROR) << "failed to save " << filename << endl;
+        return false;
+    }
+
+    dirty = false;
+    return true;
+}
+
+bool AcousticIndex::load(const string &filename)
+{
+    FILE *f = fopen(filename.c_str(), "r");
+    if (!f)
+        return false;
+
+    char magic[sizeof(Magic)];
+    int32_t dims;
+    int64_t rowid;
+    uint64_t counts[3];
+
+    bool ok = read_array(f, magic, sizeof(magic))
+        && !memcmp(magic, Magic, sizeof(Magic))
+        && read_array(f, &dims, 1) && dims == Dims
+        && read_array(f, &rowid, 1)
+        && read_array(f, &seed, 1)
+        && read_array(f, counts, 3);
+
+    size_t npoints = ok ? counts[0] : 0;
+    if (ok)
+    {
+        points.resize(npoints * Dims);
+        point_uids.resize(npoints);
+        nodes.assign(counts[2], Node());
+        ok = read_array(f, points.data(), points.size())
+            && read_array(f, point_uids.data(), npoints);
+    }
+
+    for (size_t i = 0; ok && i < nodes.size(); ++i)
+    {
+        Node &n = nodes[i];
+        int32_t links[3];
+        uint32_t size;
+        ok = read_array(f, links, 3)
+            && read_array(f, &n.radius, 1)
+            && read_array(f, &size, 1)
+            && size <= npoints;
+        if (!ok)
+            break;
+
+        n.vp = links[0];
+        n.inside = links[1];
+        n.outside = links[2];
+        n.bucket.resize(size);
+        ok = read_array(f, n.bucket.data(), size);
+
+        // Reject anything that would send a lookup out of bounds
+        if (n.vp >= 0)
+            ok = ok && n.vp < (int)npoints
+                && n.inside > (int)i && n.inside < (int)nodes.size()
+                && n.outside > (int)i && n.outside < (int)nodes.size();
+        for (size_t j = 0; ok && j < size; ++j)
+            ok = n.bucket[j] >= 0 && n.bucket[j] < (int)npoints;
+    }
+
+    fclose(f);
+
+    // A rowid we have not reached means a different acoustic database
+    if (ok)
+    {
+        try {
+            Q q("SELECT IFNULL(max(rowid), 0) FROM A.Acoustic;");
+            long latest = 0;
+            if (q.next())
+                q >> latest;
+            ok = rowid <= latest;
+        }
+        WARNIFFAILED();
+    }
+
+    live = 0;
+    uid_points.clear();
+    for (size_t p = 0; ok && p < npoints; ++p)
+    {
+        int uid = point_uids[p];
+        if (uid < 0)
+            continue;
+        if (uid >= (int)uid_points.size())
+            uid_points.resize(uid + 1, -1);
+        uid_points[uid] = p;
+        ++live;
+    }
+
+    if (!ok)
+    {
+        points.clear();
+        point_uids.clear();
+        uid_points.clear();
+        nodes.clear();
+        live = built = 0;
+        acoustic_rowid = 0;
+        return false;
+    }
+
+    built = counts[1];
+    acoustic_rowid = rowid;
+    dirty = false;
+    return true;
+}
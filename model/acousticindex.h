@@ -0,0 +1,120 @@
+/*
+ IMMS: Intelligent Multimedia Management System
+ Copyright (C) 2001-2009 Michael Grigoriev
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+*/
+#ifndef __ACOUSTICINDEX_H
+#define __ACOUSTICINDEX_H
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+#include "featurestore.h"
+
+// Where immsd keeps the index, under the imms root
+#define     ACOUSTIC_INDEX          "imms.acoustic.idx"
+
+// Approximate nearest neighbour search over the analyzed songs. Every
+// song is embedded into a fixed length vector (the moments of its
+// mixture model and the cumulative beat histogram) and the vectors are
+// kept in a vantage point tree under Euclidean distance. The embedding
+// only approximates the similarity model, so results are candidates to
+// be rescored, not a ranking.
+class AcousticIndex
+{
+public:
+    static const int Dims = 2 * Gaussian::NumDimensions +
+        DIVROUNDUP(BEATSSIZE, 5);
+
+    AcousticIndex();
+
+    // Index every song in the store
+    void build(const FeatureStore &store);
+    // Pick up songs written to A.Acoustic since the last build, load or
+    // refresh; the store must already have them. Returns the number of
+    // songs (re)inserted.
+    int refresh(const FeatureStore &store);
+
+    void insert(int uid, const AcousticView &view);
+    void remove(int uid);
+
+    // Up to k songs closest to view, closest first, leaving out exclude.
+    // The search gives up after comparing against max_checks songs;
+    // 0 makes it exact.
+    void nearest(const AcousticView &view, size_t k,
+            std::vector<int> &uids, int exclude = -1,
+            size_t max_checks = MaxChecks) const;
+
+    static const size_t MaxChecks = 1024;
+
+    // Returns false if the file is missing, corrupt or out of date
+    bool load(const std::string &filename);
+    // Only writes if anything changed since the last load or save
+    bool save(const std::string &filename);
+
+    size_t size() const { return live; }
+
+    static void embed(const AcousticView &view, float out[Dims]);
+
+private:
+    // Internal nodes split on the distance to a vantage point: points
+    // no further than radius are inside. Leaves have vp == -1.
+    struct Node
+    {
+        Node() : vp(-1), radius(0), inside(-1), outside(-1) {}
+        int vp;
+        float radius;
+        int inside, outside;
+        std::vector<int> bucket;
+    };
+
+    struct Candidate
+    {
+        float dist;
+        int point;
+        bool operator<(const Candidate &other) const
+            { return dist < other.dist; }
+        bool operator>(const Candidate &other) const
+            { return dist > other.dist; }
+    };
+
+    const float *point(int p) const { return &points[p * Dims]; }
+    float distance(const float *a, const float *b) const;
+
+    int add_point(int uid, const AcousticView &view);
+    void rebuild();
+    void make(int node, std::vector<int>::iterator begin,
+            std::vector<int>::iterator end);
+    void route(int p);
+    void search(const float *query, size_t k, int exclude,
+            size_t max_checks, std::vector<Candidate> &heap) const;
+    void consider(int p, float dist, size_t k, int exclude,
+            std::vector<Candidate> &heap) const;
+
+    std::vector<float> points;
+    std::vector<int> point_uids;    // -1 for removed points
+    std::vector<int> uid_points;    // uid -> point, or -1
+    std::vector<Node> nodes;
+
+    size_t live, built;
+    int64_t acoustic_rowid;
+    uint32_t seed;
+    bool dirty;
+};
+
+#endif
@@ -0,0 +1,362 @@
+/*
+ IMMS: Intelligent Multimedia Management System
+ Copyright (C) 2001-2009 Michael Grigoriev
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+*/
+#include <limits.h>
+#include <math.h>
+
+#include <algorithm>
+#include <iostream>
+#include <thread>
+
+#include <sqlite++.h>
+
+#include "allpairs.h"
+#include "model.h"
+
+using std::endl;
+using std::cerr;
+using std::min;
+using std::max;
+
+// Finished tiles waiting for the writer, per worker
+static const size_t MaxQueued = 4;
+
+AllPairs::AllPairs(FeatureStore &store, int threads)
+    : store(store), nrows(0), next_tile(0), aborted(false)
+{
+    if (threads <= 0)
+        threads = std::thread::hardware_concurrency();
+    // Models keep scratch state, so every worker gets its own
+    for (int i = 0; i < max(threads, 1); ++i)
+        models.emplace_back(new SVMSimilarityModel());
+
+    sql_create_tables();
+}
+
+AllPairs::~AllPairs()
+{
+}
+
+void AllPairs::sql_create_tables()
+{
+    RuntimeErrorBlocker reb;
+    try {
+        Q("CREATE TABLE A.DistanceProgress ("
+                "'done' INTEGER NOT NULL, "
+                "'target' INTEGER NOT NULL, "
+                "'next' INTEGER NOT NULL);").execute();
+
+        Q("INSERT INTO A.DistanceProgress VALUES (0, 0, 0);").execute();
+    }
+    IGNOREFAILURE();
+}
+
+bool AllPairs::load_checkpoint(Checkpoint &cp)
+{
+    try {
+        Q q("SELECT done, target, next FROM A.DistanceProgress;");
+        if (q.next())
+        {
+            q >> cp.done >> cp.target >> cp.next;
+            return true;
+        }
+    }
+    WARNIFFAILED();
+    return false;
+}
+
+bool AllPairs::start_pass(Checkpoint &cp, long latest)
+{
+    try {
+        AutoTransaction at(true);
+
+        // Songs that were reanalyzed may have left distances that
+        // would no longer make the cut
+        Q q("DELETE FROM A.Distances WHERE "
+                "x IN (SELECT uid FROM A.Acoustic "
+                    "WHERE rowid > ? AND rowid <= ?) OR "
+                "y IN (SELECT uid FROM A.Acoustic "
+                    "WHERE rowid > ? AND rowid <= ?);");
+        q << cp.done << latest << cp.done << latest;
+        q.execute();
+
+        Q u("UPDATE A.DistanceProgress SET target = ?, next = 0;");
+        u << latest;
+        u.execute();
+
+        at.commit();
+
+        cp.target = latest;
+        cp.next = 0;
+        return true;
+    }
+    WARNIFFAILED();
+    return false;
+}
+
+bool AllPairs::collect(const Checkpoint &cp)
+{
+    uids.clear();
+    views.clear();
+    tiles.clear();
+
+    std::vector<int> others;
+    std::vector<AcousticView> other_views;
+
+    bool ok = false;
+    try {
+        // Rows go in uid order, so that the checkpoint can be a uid
+        Q q("SELECT uid, rowid FROM A.Acoustic WHERE rowid <= ? "
+                "ORDER BY uid;");
+        q << cp.target;
+
+        int uid;
+        long rowid;
+        while (q.next())
+        {
+            q >> uid >> rowid;
+
+            AcousticView view;
+            if (!store.find(uid, view))
+                continue;
+
+            if (rowid > cp.done && uid >= cp.next)
+            {
+                uids.push_back(uid);
+                views.push_back(view);
+            }
+            else
+            {
+                others.push_back(uid);
+                other_views.push_back(view);
+            }
+        }
+        ok = true;
+    }
+    WARNIFFAILED();
+
+    if (!ok)
+        return false;
+
+    nrows = uids.size();
+    uids.insert(uids.end(), others.begin(), others.end());
+    views.insert(views.end(), other_views.begin(), other_views.end());
+
+    // Tiles of the upper triangle, band by band
+    int bands = DIVROUNDUP(nrows, TileSize);
+    int blocks = DIVROUNDUP(views.size(), TileSize);
+    for (int band = 0; band < bands; ++band)
+        for (int block = band; block < blocks; ++block)
+            tiles.push_back(std::make_pair(band, block));
+
+    return true;
+}
+
+void AllPairs::worker(SimilarityModel *model)
+{
+    float scores[TileSize];
+
+    while (!aborted)
+    {
+        size_t tile = next_tile++;
+        if (tile >= tiles.size())
+            return;
+
+        Batch batch;
+        batch.band = tiles[tile].first;
+        batch.scored = 0;
+
+        size_t row_begin = batch.band * TileSize;
+        size_t row_end = min(row_begin + TileSize, nrows);
+        size_t col_begin = tiles[tile].second * TileSize;
+        size_t col_end = min(col_begin + TileSize, views.size());
+
+        for (size_t i = row_begin; i < row_end; ++i)
+        {
+            size_t first = max(col_begin, i + 1);
+            if (first >= col_end)
+                continue;
+
+            size_t n = col_end - first;
+            model->evaluate_batch(views[i], &views[first], n, scores);
+            batch.scored += n;
+
+            for (size_t k = 0; k < n; ++k)
+            {
+                if (isnan(scores[k]))
+                    continue;
+
+                int dist = ROUND(scores[k] * 100);
+                if (dist < MinDistance)
+                    continue;
+
+                int other = uids[first + k];
+                Pair pair = { min(uids[i], other), max(uids[i], other), dist };
+                batch.pairs.push_back(pair);
+            }
+        }
+
+        std::unique_lock<std::mutex> lock(mutex);
+        space.wait(lock, [this] {
+                return aborted || results.size() < MaxQueued * models.size();
+            });
+        if (aborted)
+            return;
+        results.push_back(std::move(batch));
+        ready.notify_one();
+    }
+}
+
+void AllPairs::write_results(long &scored)
+{
+    std::vector<int> pending(DIVROUNDUP(nrows, TileSize), 0);
+    for (size_t i = 0; i < tiles.size(); ++i)
+        ++pending[tiles[i].first];
+
+    size_t band = 0, remaining = tiles.size();
+    while (remaining)
+    {
+        std::deque<Batch> batches;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            ready.wait(lock, [this] { return !results.empty(); });
+            batches.swap(results);
+        }
+        space.notify_all();
+
+        // Everything that piled up while the last transaction was
+        // being committed goes into the next one
+        AutoTransaction at(true);
+        Q q("INSERT OR REPLACE INTO A.Distances ('x', 'y', 'dist') "
+                "VALUES (?, ?, ?);");
+
+        for (size_t b = 0; b < batches.size(); ++b)
+        {
+            const std::vector<Pair> &pairs = batches[b].pairs;
+            for (size_t i = 0; i < pairs.size(); ++i)
+            {
+                q << pairs[i].x << pairs[i].y << pairs[i].dist;
+                q.execute();
+            }
+            scored += batches[b].scored;
+            --pending[batches[b].band];
+            --remaining;
+        }
+
+        size_t finished = band;
+        while (band < pending.size() && !pending[band])
+            ++band;
+
+        if (band != finished)
+        {
+            int next = band < pending.size() ?
+                uids[band * TileSize] : INT_MAX;
+            Q u("UPDATE A.DistanceProgress SET next = ?;");
+            u << next;
+            u.execute();
+
+            LOG(INFO) << "distances: " << min(band * TileSize, nrows)
+                << " of " << nrows << " songs done" << endl;
+        }
+
+        at.commit();
+    }
+}
+
+bool AllPairs::run_pass(long &scored)
+{
+    next_tile = 0;
+    aborted = false;
+    results.clear();
+
+    std::vector<std::thread> workers;
+    for (size_t i = 0; i < models.size(); ++i)
+        workers.emplace_back(&AllPairs::worker, this, models[i].get());
+
+    bool ok = false;
+    try {
+        write_results(scored);
+        ok = true;
+    }
+    WARNIFFAILED();
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        aborted = !ok;
+    }
+    space.notify_all();
+
+    for (size_t i = 0; i < workers.size(); ++i)
+        workers[i].join();
+
+    return ok;
+}
+
+long AllPairs::update()
+{
+    long scored = 0;
+
+    if (!SQLDatabaseConnection::threadsafe())
+    {
+        LOG(ERROR) << "SQLite was built without thread support" << endl;
+        return scored;
+    }
+
+    while (true)
+    {
+        store.refresh();
+
+        Checkpoint cp;
+        if (!load_checkpoint(cp))
+            break;
+
+        if (cp.target <= cp.done)
+        {
+            long latest = 0;
+            try {
+                Q q("SELECT IFNULL(max(rowid), 0) FROM A.Acoustic;");
+                if (q.next())
+                    q >> latest;
+            }
+            WARNIFFAILED();
+
+            if (latest <= cp.done)
+                break;
+            if (!start_pass(cp, latest))
+                break;
+        }
+        else
+            LOG(INFO) << "distances: resuming an interrupted pass" << endl;
+
+        if (!collect(cp) || !run_pass(scored))
+            break;
+
+        bool finished = false;
+        try {
+            Q("UPDATE A.DistanceProgress SET done = target, next = 0;")
+                .execute();
+            finished = true;
+        }
+        WARNIFFAILED();
+
+        if (!finished)
+            break;
+    }
+
+    return scored;
+}
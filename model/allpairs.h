@@ -0,0 +1,103 @@
+/*
+ IMMS: Intelligent Multimedia Management System
+ Copyright (C) 2001-2009 Michael Grigoriev
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+*/
+#ifndef __ALLPAIRS_H
+#define __ALLPAIRS_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "featurestore.h"
+
+class SimilarityModel;
+
+// Keeps A.Distances filled with the acoustic distance between every
+// pair of analyzed songs. Each pass scores the songs analyzed since the
+// previous one against all others: the pairs are cut into square tiles
+// that a pool of worker threads scores out of the in-memory feature
+// store, while the calling thread, which owns the database connection,
+// writes the results. Progress is checkpointed in A.DistanceProgress,
+// so an interrupted pass picks up where it left off.
+class AllPairs
+{
+public:
+    // Don't bother with distance < 0.3.
+    // This way we only get a list of strongly correlated songs.
+    static const int MinDistance = 30;
+    // Songs per side of a tile; two tiles of features fit in L2
+    static const int TileSize = 64;
+
+    // threads = 0 uses one per core
+    AllPairs(FeatureStore &store, int threads = 0);
+    ~AllPairs();
+
+    // Run passes until every analyzed song is covered.
+    // Returns the number of pairs scored.
+    long update();
+
+    static void sql_create_tables();
+
+private:
+    AllPairs(const AllPairs &);
+    AllPairs &operator=(const AllPairs &);
+
+    struct Checkpoint
+    {
+        long done;      // all songs up to this A.Acoustic rowid are covered
+        long target;    // the pass in progress covers songs up to here
+        int next;       // rows with a uid below this are finished
+    };
+
+    struct Pair { int x, y, dist; };
+    struct Batch
+    {
+        int band;
+        long scored;
+        std::vector<Pair> pairs;
+    };
+
+    bool load_checkpoint(Checkpoint &cp);
+    bool start_pass(Checkpoint &cp, long latest);
+    bool collect(const Checkpoint &cp);
+    bool run_pass(long &scored);
+    void write_results(long &scored);
+    void worker(SimilarityModel *model);
+
+    FeatureStore &store;
+    std::vector<std::unique_ptr<SimilarityModel> > models;
+
+    // The first nrows songs are scored against every song after them
+    std::vector<int> uids;
+    std::vector<AcousticView> views;
+    size_t nrows;
+
+    // (band, column block), bands being blocks of rows
+    std::vector<std::pair<int, int> > tiles;
+    std::atomic<size_t> next_tile;
+    std::atomic<bool> aborted;
+
+    std::mutex mutex;
+    std::condition_variable ready, space;
+    std::deque<Batch> results;
+};
+
+#endif
@@ -24,52 +24,100 @@
 #include <string.h>
 
 #include "distance.h"
-#include "emd.h"
+#include "transport.h"
 
 using std::cerr;
 using std::endl;
 
-float KL_Divergence(const Gaussian &g1, const Gaussian &g2)
+typedef float v4sf __attribute__ ((vector_size (16)));
+
+// Symmetric KL divergence between every gaussian of m1 and every
+// gaussian of m2. The gaussians of m2 are transposed into the lanes of
+// a vector, so each row of the cost matrix takes one sweep over the
+// dimensions; every lane still sums in dimension order, exactly as the
+// one-pair-at-a-time loop did.
+static void KL_Divergences(const AcousticView &m1, const AcousticView &m2,
+        float cost[NUMGAUSS][NUMGAUSS])
 {
-    float total = 0;
-    for (int i = 0; i < Gaussian::NumDimensions; ++i)
+    static const int Dims = Gaussian::NumDimensions;
+    static const int Blocks = DIVROUNDUP(NUMGAUSS, 4);
+    // Enforce a minimum for variences so we don't get huge distances
+    const float MinVariance = 10.0f;
+
+    // Unused lanes get a harmless variance of 1
+    v4sf means2[Dims][Blocks], vars2[Dims][Blocks], inv2[Dims][Blocks];
+    for (int d = 0; d < Dims; ++d)
+        for (int b = 0; b < Blocks; ++b)
+        {
+            means2[d][b] = v4sf();
+            vars2[d][b] = inv2[d][b] = (v4sf){ 1, 1, 1, 1 };
+        }
+
+    for (int j = 0; j < NUMGAUSS; ++j)
     {
-        // Enforce a minimum for variences so we don't get huge distances
-        const float MinVariance = 10.0f;
-        float var1 = std::max(g1.vars[i], MinVariance);
-        float var2 = std::max(g2.vars[i], MinVariance);
-        float dist = var1 / var2 + var2 / var1 +
-            pow(g1.means[i] - g2.means[i], 2.0f) *
-            (1.0f / var1 + 1.0f / var2);
-
-        total += dist - 2;
+        const float *means = m2.mean(j), *vars = m2.var(j);
+        for (int d = 0; d < Dims; ++d)
+        {
+            float var = std::max(vars[d], MinVariance);
+            means2[d][j / 4][j % 4] = means[d];
+            vars2[d][j / 4][j % 4] = var;
+            inv2[d][j / 4][j % 4] = 1.0f / var;
+        }
     }
-    return total;
-}
 
-float EMD::cost[NUMGAUSS][NUMGAUSS];
+    const v4sf two = { 2, 2, 2, 2 };
+    for (int i = 0; i < NUMGAUSS; ++i)
+    {
+        const float *means1 = m1.mean(i), *vars1 = m1.var(i);
+
+        v4sf total[Blocks];
+        for (int b = 0; b < Blocks; ++b)
+            total[b] = v4sf();
+
+        for (int d = 0; d < Dims; ++d)
+        {
+            float var = std::max(vars1[d], MinVariance), inv = 1.0f / var;
+            v4sf var1 = { var, var, var, var };
+            v4sf inv1 = { inv, inv, inv, inv };
+            v4sf mean1 = { means1[d], means1[d], means1[d], means1[d] };
+
+            for (int b = 0; b < Blocks; ++b)
+            {
+                v4sf var2 = vars2[d][b];
+                v4sf delta = mean1 - means2[d][b];
+                v4sf dist = var1 / var2 + var2 / var1 +
+                    delta * delta * (inv1 + inv2[d][b]);
+                total[b] += dist - two;
+            }
+        }
+
+        for (int j = 0; j < NUMGAUSS; ++j)
+            cost[i][j] = total[j / 4][j % 4];
+    }
+}
 
 float EMD::raw_distance(const MixtureModel &m1, const MixtureModel &m2)
 {
-    feature_t features[NUMGAUSS];
-    float w1[NUMGAUSS], w2[NUMGAUSS];
+    return raw_distance(AcousticView(m1, 0), AcousticView(m2, 0));
+}
+
+float EMD::raw_distance(const AcousticView &m1, const AcousticView &m2)
+{
+    float w1[NUMGAUSS], w2[NUMGAUSS], cost[NUMGAUSS][NUMGAUSS];
 
     for (int i = 0; i < NUMGAUSS; ++i)
     {
-        features[i] = i;
-        w1[i] = m1.gauss[i].weight;
-        w2[i] = m2.gauss[i].weight;
-
-        for (int j = 0; j < NUMGAUSS; ++j)
-            cost[i][j] = KL_Divergence(m1.gauss[i], m2.gauss[j]);
+        w1[i] = m1.weight(i);
+        w2[i] = m2.weight(i);
     }
 
-    signature_t s1 = { NUMGAUSS, features, w1 };
-    signature_t s2 = { NUMGAUSS, features, w2 };
-    return emd(&s1, &s2, EMD::gauss_dist, 0, 0);
+    KL_Divergences(m1, m2, cost);
+
+    TransportSolver<NUMGAUSS, NUMGAUSS> solver;
+    return solver.solve(cost, w1, w2);
 }
 
-static bool normalize_beat_graph(float beats[BEATSSIZE], float *output, int comb)
+static bool normalize_beat_graph(const float *beats, float *output, int comb)
 {
     float sum = 0, min = 1e100;
 
@@ -91,16 +139,13 @@ static bool normalize_beat_graph(float beats[BEATSSIZE], float *output, int comb
     return true;
 }
 
-float EMD::raw_distance(float beats1[BEATSSIZE], float beats2[BEATSSIZE])
+bool EMD::closed_form_beats = false;
+
+float EMD::raw_distance(const float *beats1, const float *beats2)
 {
     static const int comb = 5;
     static const int OUTSIZE = DIVROUNDUP(BEATSSIZE, comb);
 
-    feature_t features[OUTSIZE];
-
-    for (int i = 0; i < OUTSIZE; ++i)
-        features[i] = i;
-
     float b1[OUTSIZE], b2[OUTSIZE];
     memset(b1, 0, sizeof(b1));
     memset(b2, 0, sizeof(b2));
@@ -110,9 +155,38 @@ float EMD::raw_distance(float beats1[BEATSSIZE], float beats2[BEATSSIZE])
     if (!normalize_beat_graph(beats2, b2, comb))
         return -1;
 
-    signature_t s1 = { OUTSIZE, features, b1 };
-    signature_t s2 = { OUTSIZE, features, b2 };
-    return emd(&s1, &s2, EMD::linear_dist, 0, 0);
+    if (closed_form_beats)
+    {
+        // In 1-D with |i - j| as the ground distance, the EMD between
+        // histograms of equal mass is the L1 distance between their
+        // cumulative sums. The masses are normally equal to within float
+        // rounding, and the same EPSILON test as in emd.c decides that.
+        double sum1 = 0, sum2 = 0, total = 0;
+        for (int i = 0; i < OUTSIZE; ++i)
+        {
+            sum1 += b1[i];
+            sum2 += b2[i];
+            if (i < OUTSIZE - 1)
+                total += fabs(sum1 - sum2);
+        }
+
+        // Partial matching has no closed form
+        if (fabs(sum1 - sum2) < EPSILON * sum1)
+            return (float)(total / (float)(sum1 > sum2 ? sum2 : sum1));
+    }
+
+    struct LinearCost {
+        LinearCost() {
+            for (int i = 0; i < OUTSIZE; ++i)
+                for (int j = 0; j < OUTSIZE; ++j)
+                    cost[i][j] = abs(i - j);
+        }
+        float cost[OUTSIZE][OUTSIZE];
+    };
+    static const LinearCost linear;
+
+    TransportSolver<OUTSIZE, OUTSIZE> solver;
+    return solver.solve(linear.cost, b1, b2);
 }
 
 float song_cepstr_distance(int uid1, int uid2)
@@ -26,15 +26,18 @@
 #include <analyzer/mfcckeeper.h>
 #include <analyzer/beatkeeper.h>
 
+#include "featurestore.h"
+
+// All distances are reentrant: any scratch space lives on the stack
 struct EMD {
     static float raw_distance(const MixtureModel &m1, const MixtureModel &m2);
-    static float raw_distance(float beats1[BEATSSIZE], float beats2[BEATSSIZE]);
-private:
-    static float gauss_dist(int *f1, int *f2)
-        { return cost[*f1][*f2]; }
-    static float linear_dist(int *f1, int *f2)
-        { return abs(*f1 - *f2); }
-    static float cost[NUMGAUSS][NUMGAUSS];
+    static float raw_distance(const AcousticView &m1, const AcousticView &m2);
+    static float raw_distance(const float *beats1, const float *beats2);
+
+    // Beat graphs of equal mass have a closed form distance, which is
+    // much faster than the solver but only agrees with it to within float
+    // rounding (about 1e-5 relative). Off unless asked for.
+    static bool closed_form_beats;
 };
 
 float song_cepstr_distance(int uid1, int uid2);
@@ -0,0 +1,224 @@
+/*
+ IMMS: Intelligent Multimedia Management System
+ Copyright (C) 2001-2009 Michael Grigoriev
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+*/
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+
+#include <sqlite++.h>
+
+#include "featurestore.h"
+
+using std::endl;
+
+// Distance between consecutive Gaussians of a MixtureModel, in floats
+static const int ModelStride = sizeof(Gaussian) / sizeof(float);
+
+AcousticView::AcousticView(const MixtureModel &mm, const float *beats)
+    : weights(&mm.gauss[0].weight), means(mm.gauss[0].means),
+      vars(mm.gauss[0].vars), beats(beats),
+      wstride(ModelStride), stride(ModelStride)
+{
+}
+
+void AcousticView::copy_to(MixtureModel *mm, float *beats) const
+{
+    if (mm)
+    {
+        for (int i = 0; i < NUMGAUSS; ++i)
+        {
+            Gaussian &g = mm->gauss[i];
+            g.weight = weight(i);
+            memcpy(g.means, mean(i), sizeof(g.means));
+            memcpy(g.vars, var(i), sizeof(g.vars));
+        }
+    }
+    if (beats)
+        memcpy(beats, this->beats, sizeof(float) * BEATSSIZE);
+}
+
+FeatureStore::FeatureStore()
+    : weights(0), means(0), vars(0), beats(0), capacity(0),
+      acoustic_rowid(0)
+{
+}
+
+FeatureStore::~FeatureStore()
+{
+    free(weights);
+    free(means);
+    free(vars);
+    free(beats);
+}
+
+static float *grow_array(float *old, size_t oldsize, size_t newsize)
+{
+    void *p;
+    if (posix_memalign(&p, 64, newsize * sizeof(float)))
+        throw std::bad_alloc();
+    float *result = static_cast<float*>(p);
+    if (old)
+        memcpy(result, old, oldsize * sizeof(float));
+    memset(result + oldsize, 0, (newsize - oldsize) * sizeof(float));
+    free(old);
+    return result;
+}
+
+void FeatureStore::reserve(size_t n)
+{
+    if (n <= capacity)
+        return;
+
+    n = std::max(n, capacity * 2);
+
+    weights = grow_array(weights, capacity * WeightsStride, n * WeightsStride);
+    means = grow_array(means, capacity * MeansStride, n * MeansStride);
+    vars = grow_array(vars, capacity * MeansStride, n * MeansStride);
+    beats = grow_array(beats, capacity * BeatsStride, n * BeatsStride);
+
+    capacity = n;
+}
+
+int FeatureStore::slot_for(int uid)
+{
+    if (uid >= (int)slots.size())
+        slots.resize(uid + 1, -1);
+
+    if (slots[uid] < 0)
+    {
+        reserve(uids.size() + 1);
+        slots[uid] = uids.size();
+        uids.push_back(uid);
+    }
+
+    return slots[uid];
+}
+
+AcousticView FeatureStore::at(int slot) const
+{
+    AcousticView view;
+    view.weights = weights + slot * WeightsStride;
+    view.means = means + slot * MeansStride;
+    view.vars = vars + slot * MeansStride;
+    view.beats = beats + slot * BeatsStride;
+    view.wstride = 1;
+    view.stride = GaussStride;
+    return view;
+}
+
+bool FeatureStore::find(int uid, AcousticView &view) const
+{
+    if (uid < 0 || uid >= (int)slots.size() || slots[uid] < 0)
+        return false;
+    view = at(slots[uid]);
+    return true;
+}
+
+void FeatureStore::set(int uid, const MixtureModel &mm, const float *b)
+{
+    if (uid < 0)
+        return;
+
+    int slot = slot_for(uid);
+
+    for (int i = 0; i < NUMGAUSS; ++i)
+    {
+        const Gaussian &g = mm.gauss[i];
+        weights[slot * WeightsStride + i] = g.weight;
+        memcpy(means + slot * MeansStride + i * GaussStride,
+                g.means, sizeof(g.means));
+        memcpy(vars + slot * MeansStride + i * GaussStride,
+                g.vars, sizeof(g.vars));
+    }
+    memcpy(beats + slot * BeatsStride, b, sizeof(float) * BEATSSIZE);
+}
+
+void FeatureStore::load()
+{
+    slots.clear();
+    uids.clear();
+    acoustic_rowid = 0;
+
+    try {
+        Q q("SELECT count(1), IFNULL(max(uid), 0) FROM A.Acoustic;");
+        if (q.next())
+        {
+            int count, maxuid;
+            q >> count >> maxuid;
+            reserve(count);
+            slots.reserve(maxuid + 1);
+        }
+    }
+    WARNIFFAILED();
+
+    refresh();
+}
+
+int FeatureStore::refresh()
+{
+    int updated = 0;
+
+    try {
+        // INSERT OR REPLACE gives a rewritten row a new rowid,
+        // so this also picks up songs that were reanalyzed
+        Q q("SELECT rowid, uid, mfcc, bpm FROM A.Acoustic "
+                "WHERE rowid > ? AND mfcc NOTNULL AND bpm NOTNULL "
+                "ORDER BY rowid;");
+        q << (long)acoustic_rowid;
+
+        while (q.next())
+        {
+            long rowid;
+            int uid;
+            const void *mfcc, *bpm;
+            size_t mfcc_size, bpm_size;
+            q >> rowid >> uid;
+            q.view(mfcc, mfcc_size).view(bpm, bpm_size);
+            acoustic_rowid = rowid;
+
+            if (uid < 0 || mfcc_size != MFCCKeeper::ResultSize
+                    || bpm_size != sizeof(float) * BEATSSIZE)
+                continue;
+
+            read(slot_for(uid), (const char *)mfcc, (const char *)bpm);
+            ++updated;
+        }
+    }
+    WARNIFFAILED();
+
+    return updated;
+}
+
+void FeatureStore::read(int slot, const char *mfcc, const char *bpm)
+{
+    for (int i = 0; i < NUMGAUSS; ++i)
+    {
+        const char *g = mfcc + i * sizeof(Gaussian);
+        memcpy(weights + slot * WeightsStride + i,
+                g + offsetof(Gaussian, weight), sizeof(float));
+        memcpy(means + slot * MeansStride + i * GaussStride,
+                g + offsetof(Gaussian, means),
+                sizeof(float) * Gaussian::NumDimensions);
+        memcpy(vars + slot * MeansStride + i * GaussStride,
+                g + offsetof(Gaussian, vars),
+                sizeof(float) * Gaussian::NumDimensions);
+    }
+    memcpy(beats + slot * BeatsStride, bpm, sizeof(float) * BEATSSIZE);
+}
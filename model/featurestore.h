@@ -0,0 +1,95 @@
+/*
+ IMMS: Intelligent Multimedia Management System
+ Copyright (C) 2001-2009 Michael Grigoriev
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+*/
+#ifndef __FEATURESTORE_H
+#define __FEATURESTORE_H
+
+#include <stdint.h>
+
+#include <vector>
+
+#include <analyzer/mfcckeeper.h>
+#include <analyzer/beatkeeper.h>
+#include <immsutil.h>
+
+// Read-only view of one song's acoustic features. Gaussian i has its
+// weight at weights[i * wstride] and its means and variances at
+// means/vars + i * stride. The beat graph is BEATSSIZE floats.
+struct AcousticView
+{
+    AcousticView() : weights(0), means(0), vars(0), beats(0),
+        wstride(0), stride(0) {}
+    AcousticView(const MixtureModel &mm, const float *beats);
+
+    const float &weight(int g) const { return weights[g * wstride]; }
+    const float *mean(int g) const { return means + g * stride; }
+    const float *var(int g) const { return vars + g * stride; }
+
+    void copy_to(MixtureModel *mm, float *beats) const;
+
+    const float *weights, *means, *vars, *beats;
+    int wstride, stride;
+};
+
+// All analyzed songs, kept in memory as a structure of arrays indexed
+// by a dense slot number. Every per song block is 64 byte aligned.
+class FeatureStore
+{
+public:
+    // Floats per song in each of the arrays (padded to 64 bytes)
+    static const int WeightsStride = 16;
+    static const int GaussStride = 48;
+    static const int MeansStride = NUMGAUSS * GaussStride;
+    static const int BeatsStride = DIVROUNDUP(BEATSSIZE, 16) * 16;
+
+    FeatureStore();
+    ~FeatureStore();
+
+    // Load everything from A.Acoustic
+    void load();
+    // Pick up rows written since the last load/refresh;
+    // returns the number of songs updated
+    int refresh();
+
+    // Views stay valid until the next load(), refresh() or set()
+    bool find(int uid, AcousticView &view) const;
+    void set(int uid, const MixtureModel &mm, const float *beats);
+
+    size_t size() const { return uids.size(); }
+    int uid_at(int slot) const { return uids[slot]; }
+    AcousticView at(int slot) const;
+
+private:
+    FeatureStore(const FeatureStore &);
+    FeatureStore &operator=(const FeatureStore &);
+
+    void reserve(size_t n);
+    int slot_for(int uid);
+    // Copy a song's features into its slot straight from the mfcc and
+    // bpm BLOBs, which need not be aligned
+    void read(int slot, const char *mfcc, const char *bpm);
+
+    float *weights, *means, *vars, *beats;
+    size_t capacity;
+    int64_t acoustic_rowid;
+
+    std::vector<int> slots;     // uid -> slot, or -1
+    std::vector<int> uids;      // slot -> uid
+};
+
+#endif
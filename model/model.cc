@@ -34,6 +34,8 @@
 #undef max
 #endif  // WITH_TORCH
 
+#include <assert.h>
+
 #include <iostream>
 #include <vector>
 #include <algorithm>
@@ -87,15 +89,20 @@ public:
     {
         normalizer.preProcessInputs(sequence);
     }
+    const real *mean() const { return normalizer.inputs_mean; }
+    const real *stdv() const { return normalizer.inputs_stdv; }
 private:
     MyMemoryDataSet fake;
     MeanVarNorm normalizer;
 };
 
+typedef float v4sf __attribute__ ((vector_size (16)));
+
 class SVMModel : public Model {
 public:
     SVMModel()
-        : kernel(1./(stdv*stdv)), svm(&kernel), normalizer(num_inputs)
+        : kernel(1./(stdv*stdv)), svm(&kernel), normalizer(num_inputs),
+          offset(0), fast(false)
     {
         unique_ptr<XFile> model;
         string filename = get_imms_root("svm-similarity");
@@ -110,9 +117,31 @@ public:
         }
         normalizer.load(model.get());
         svm.loadXFile(model.get());
+
+        prepare_batch();
     }
 
     float evaluate(float *features) {
+        if (fast)
+        {
+            float result;
+            evaluate_batch(features, 1, &result);
+            return result;
+        }
+        return evaluate_torch(features);
+    }
+
+    void evaluate_batch(const float *features, size_t n, float *out)
+    {
+        if (!fast)
+            return Model::evaluate_batch(features, n, out);
+
+        for (size_t k = 0; k < n; ++k)
+            out[k] = (kernel_sum(features + k * num_inputs) + offset) / 3;
+    }
+     
+private:
+    float evaluate_torch(float *features) {
         // Garbage, I tell you!!
         Sequence feat_seq(0, num_inputs);
         feat_seq.addFrame(features);
@@ -122,11 +151,115 @@ public:
         svm.forward(&feat_seq);
         return svm.outputs->frames[0][0] / 3;
     }
-     
-private:
+
+    // Fold the input normalization and the kernel width into the support
+    // vectors, so that for an unnormalized input x
+    //      K(x, sv_i) = exp(-sum_j scale_j * (x_j - centers_ij)^2)
+    // Centers are stored feature major, four support vectors per v4sf.
+    void prepare_batch()
+    {
+        int nsv = svm.n_support_vectors;
+        blocks = DIVROUNDUP(nsv, 4);
+        if (!nsv)
+            return;
+
+        const real *mean = normalizer.mean(), *sd = normalizer.stdv();
+        real g = 1. / (stdv * stdv);
+
+        centers.assign(blocks * num_inputs, v4sf());
+        alphas.assign(blocks, v4sf());
+        dists.resize(blocks);
+
+        float *c = reinterpret_cast<float*>(&centers[0]);
+        float *a = reinterpret_cast<float*>(&alphas[0]);
+
+        for (int j = 0; j < num_inputs; ++j)
+            scale[j] = g / (sd[j] * sd[j]);
+
+        for (int i = 0; i < nsv; ++i)
+        {
+            a[i] = svm.sv_alpha[i];
+            const real *sv = svm.sv_sequences[i]->frames[0];
+            for (int j = 0; j < num_inputs; ++j)
+                c[j * blocks * 4 + i] = mean[j] + sd[j] * sv[j];
+        }
+        // Padding has a zero alpha, and so does not contribute anything
+
+        self_check(c);
+    }
+
+    float kernel_sum(const float *x)
+    {
+        for (int b = 0; b < blocks; ++b)
+            dists[b] = v4sf();
+
+        const v4sf *c = &centers[0];
+        for (int j = 0; j < num_inputs; ++j)
+        {
+            v4sf xj = { x[j], x[j], x[j], x[j] };
+            v4sf sj = { scale[j], scale[j], scale[j], scale[j] };
+            for (int b = 0; b < blocks; ++b, ++c)
+            {
+                v4sf d = xj - *c;
+                dists[b] += sj * d * d;
+            }
+        }
+
+        float sum = 0;
+        const float *d = reinterpret_cast<const float*>(&dists[0]);
+        const float *a = reinterpret_cast<const float*>(&alphas[0]);
+        for (int i = 0; i < blocks * 4; ++i)
+            sum += a[i] * expf(-d[i]);
+        return sum;
+    }
+
+    // The folded form has to agree with Torch before it is trusted.
+    // Support vectors themselves (and points between them) make for
+    // probes that actually exercise the kernel.
+    void self_check(const float *c)
+    {
+        int nprobes = std::min(svm.n_support_vectors, 4);
+        float probes[8][num_inputs];
+
+        for (int p = 0; p < nprobes; ++p)
+            for (int j = 0; j < num_inputs; ++j)
+            {
+                probes[p][j] = c[j * blocks * 4 + p];
+                probes[p + nprobes][j] = (c[j * blocks * 4 + p]
+                        + c[j * blocks * 4 + nprobes - 1 - p]) / 2 + 0.5;
+            }
+
+        // Torch adds the bias term itself; measure it instead of
+        // relying on its sign convention
+        float x[num_inputs];
+        std::copy(probes[0], probes[0] + num_inputs, x);
+        offset = evaluate_torch(x) * 3 - kernel_sum(probes[0]);
+
+        for (int p = 1; p < nprobes * 2; ++p)
+        {
+            std::copy(probes[p], probes[p] + num_inputs, x);
+            float expected = evaluate_torch(x);
+            float got = (kernel_sum(probes[p]) + offset) / 3;
+            if (fabs(expected - got) > 1e-3 * std::max(1.f, fabsf(expected)))
+            {
+                LOG(ERROR) << "warning: batch SVM evaluation disagrees "
+                    "with torch (" << got << " vs " << expected
+                    << "), not using it" << endl;
+                return;
+            }
+        }
+
+        fast = true;
+    }
+
     GaussianKernel kernel;
     SVMClassification svm;
     Normalizer normalizer;
+
+    int blocks;
+    float scale[num_inputs], offset;
+    vector<v4sf> centers, alphas, dists;
+    bool fast;
 };
 
 SVMSimilarityModel::SVMSimilarityModel()
@@ -138,6 +271,18 @@ SVMSimilarityModel::SVMSimilarityModel()
     : SimilarityModel(new DummyModel()) { }
 #endif  // WITH_TORCH
 
+void Model::evaluate_batch(const float *features, size_t n, float *out)
+{
+    float f[NUM_FEATURES];
+    for (size_t i = 0; i < n; ++i)
+    {
+        // evaluate() is allowed to scribble over its input
+        std::copy(features + i * NUM_FEATURES,
+                features + (i + 1) * NUM_FEATURES, f);
+        out[i] = evaluate(f);
+    }
+}
+
 SimilarityModel::SimilarityModel(Model *model) : model(model)
 {
 }
@@ -148,10 +293,14 @@ SimilarityModel::~SimilarityModel()
 
 float SimilarityModel::evaluate(const MixtureModel &mm1, float *beats1,
         const MixtureModel &mm2, float *beats2) {
-    vector<float> features;
-    extract_features(mm1, beats1, mm2, beats2, &features);
+    return evaluate(AcousticView(mm1, beats1), AcousticView(mm2, beats2));
+}
+
+float SimilarityModel::evaluate(const AcousticView &a1, const AcousticView &a2)
+{
     float feat_array[NUM_FEATURES];
-    std::copy(features.begin(), features.end(), feat_array);
+    if (!extract_features(a1, a2, feat_array))
+        return 0;
     return evaluate(feat_array);
 }
 
@@ -160,6 +309,29 @@ float SimilarityModel::evaluate(float *features)
     return model->evaluate(features);
 }
 
+void SimilarityModel::evaluate_batch(const float *features, size_t n,
+        float *out)
+{
+    model->evaluate_batch(features, n, out);
+}
+
+void SimilarityModel::evaluate_batch(const AcousticView &pivot,
+        const AcousticView *others, size_t n, float *out)
+{
+    if (scratch.size() < n * NUM_FEATURES)
+        scratch.resize(n * NUM_FEATURES);
+
+    vector<size_t> failed;
+    for (size_t i = 0; i < n; ++i)
+        if (!extract_features(pivot, others[i], &scratch[i * NUM_FEATURES]))
+            failed.push_back(i);
+
+    model->evaluate_batch(&scratch[0], n, out);
+
+    for (size_t i = 0; i < failed.size(); ++i)
+        out[failed[i]] = NAN;
+}
+
 float SimilarityModel::evaluate(const Song &s1, const Song &s2)
 {
     MixtureModel mm1, mm2;
@@ -172,17 +344,17 @@ float SimilarityModel::evaluate(const Song &s1, const Song &s2)
 
     return evaluate(mm1, b1, mm2, b2);
 }
-static float find_max(float a[BEATSSIZE])
+static float find_max(const float *a)
 {
     return *std::max_element(a, a + BEATSSIZE);
 }
 
-static float find_min(float a[BEATSSIZE])
+static float find_min(const float *a)
 {
     return *std::min_element(a, a + BEATSSIZE);
 }
 
-static void add_partitions(const MixtureModel &mm, vector<float> *f)
+static float *add_partitions(const AcousticView &a, float *f)
 {
     static const int num_partitions = 3;
     float sums[num_partitions];
@@ -190,30 +362,54 @@ static void add_partitions(const MixtureModel &mm, vector<float> *f)
         sums[i] = 0;
     for (int i = 0; i < NUMGAUSS; ++i)
     {
-        const Gaussian &g = mm.gauss[i];
+        const float *means = a.mean(i);
         for (int j = 0; j < NUMCEPSTR; ++j)
-            sums[j / (NUMCEPSTR / num_partitions)] += g.weight * g.means[j];
+            sums[j / (NUMCEPSTR / num_partitions)] += a.weight(i) * means[j];
     }
     for (int i = 0; i < num_partitions; ++i)
-        f->push_back(sums[i]);
+        *f++ = sums[i];
+    return f;
 } 
 
-
-void SimilarityModel::extract_features(
+bool SimilarityModel::extract_features(
         const MixtureModel &mm1, float *beats1,
         const MixtureModel &mm2, float *beats2,
         vector<float> *f)
 {
-    f->push_back(EMD::raw_distance(mm1, mm2));
-    f->push_back(EMD::raw_distance(beats1, beats2));
+    return extract_features(AcousticView(mm1, beats1),
+            AcousticView(mm2, beats2), f);
+}
 
-    add_partitions(mm1, f);
-    add_partitions(mm2, f);
+bool SimilarityModel::extract_features(
+        const AcousticView &a1, const AcousticView &a2, vector<float> *f)
+{
+    float features[NUM_FEATURES];
+    if (!extract_features(a1, a2, features))
+        return false;
+    f->insert(f->end(), features, features + NUM_FEATURES);
+    return true;
+}
+
+bool SimilarityModel::extract_features(
+        const AcousticView &a1, const AcousticView &a2,
+        float features[NUM_FEATURES])
+{
+    float *f = features;
 
-    f->push_back(find_max(beats1));
-    f->push_back(find_max(beats2));
+    *f++ = EMD::raw_distance(a1, a2);
+    *f++ = EMD::raw_distance(a1.beats, a2.beats);
 
-    f->push_back(find_min(beats1));
-    f->push_back(find_min(beats2));
-}
+    f = add_partitions(a1, f);
+    f = add_partitions(a2, f);
 
+    *f++ = find_max(a1.beats);
+    *f++ = find_max(a2.beats);
+
+    *f++ = find_min(a1.beats);
+    *f++ = find_min(a2.beats);
+
+    assert(f == features + NUM_FEATURES);
+
+    // The solver returns -1 on an internal error
+    return features[0] >= 0 && features[1] >= 0;
+}
@@ -25,13 +25,16 @@
 #define NUM_FEATURES 12
 
 class Song;
-class MixtureModel;
+struct MixtureModel;
+struct AcousticView;
 
 class Model
 {
 public:
     virtual ~Model() {};
     virtual float evaluate(float *features) = 0;
+    // Evaluate n feature vectors of NUM_FEATURES each
+    virtual void evaluate_batch(const float *features, size_t n, float *out);
 };
 
 class DummyModel : public Model
@@ -48,15 +51,31 @@ public:
     float evaluate(const Song &s1, const Song &s2);
     float evaluate(const MixtureModel &mm1, float *beats1,
                    const MixtureModel &mm2, float *beats2);
+    float evaluate(const AcousticView &a1, const AcousticView &a2);
 
     float evaluate(float *features);
 
-    static void extract_features(
+    void evaluate_batch(const float *features, size_t n, float *out);
+    // Score every one of others against pivot; NAN where the distances
+    // could not be computed
+    void evaluate_batch(const AcousticView &pivot,
+            const AcousticView *others, size_t n, float *out);
+
+    // These return false if either EMD failed; the vector is then left
+    // as it was
+    static bool extract_features(
             const MixtureModel &mm1, float *beats1,
             const MixtureModel &mm2, float *beats2,
             std::vector<float> *features);
+    static bool extract_features(
+            const AcousticView &a1, const AcousticView &a2,
+            std::vector<float> *features);
+    static bool extract_features(
+            const AcousticView &a1, const AcousticView &a2,
+            float features[NUM_FEATURES]);
 private:
     std::unique_ptr<Model> model;
+    std::vector<float> scratch;
 };
 
 class SVMSimilarityModel : public SimilarityModel {
@@ -0,0 +1,663 @@
+/*
+ IMMS: Intelligent Multimedia Management System
+ Copyright (C) 2001-2009 Michael Grigoriev
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+*/
+#ifndef __TRANSPORT_H
+#define __TRANSPORT_H
+
+#include <stddef.h>
+#include <math.h>
+
+#include "emd.h"
+
+// A port of the transportation simplex in emd.c, specialized at compile
+// time for signatures of N1 and N2 features. The cost matrix is passed
+// in rather than computed through a callback, and all state lives in
+// the object, so separate solvers can be used concurrently. The order
+// of every floating point operation is the same as in emd.c, so the
+// results are bit for bit identical. Where emd.c would print an error
+// and exit, the solver returns -1; like emd.c, it returns the cost of
+// the best flow so far if it runs out of iterations.
+template <int N1, int N2>
+class TransportSolver
+{
+public:
+    float solve(const float cost[N1][N2], const float *w1, const float *w2);
+
+private:
+    enum { M1 = N1 + 1, M2 = N2 + 1, NX = N1 + N2 + 2 };
+
+    struct node1_t {
+        int i;
+        double val;
+        node1_t *Next;
+    };
+
+    struct node2_t {
+        int i, j;
+        double val;
+        node2_t *NextC;     // next column
+        node2_t *NextR;     // next row
+    };
+
+    float init(const float cost[N1][N2], const float *w1, const float *w2);
+    // These return false, or -1, on an internal error
+    bool findBasicVariables(node1_t *U, node1_t *V);
+    int isOptimal(node1_t *U, node1_t *V);
+    int findLoop(node2_t **Loop);
+    bool newSol();
+    void russel(double *S, double *D);
+    void addBasicVariable(int minI, int minJ, double *S, double *D,
+            node1_t *PrevUMinI, node1_t *PrevVMinJ, node1_t *UHead);
+
+    int n1, n2;
+    float C[M1][M2];
+    node2_t X[NX];
+    node2_t *EndX, *EnterX;
+    char IsX[M1][M2];
+    node2_t *RowsX[M1], *ColsX[M2];
+    double maxW;
+    float maxC;
+};
+
+template <int N1, int N2>
+float TransportSolver<N1, N2>::solve(const float cost[N1][N2],
+        const float *w1, const float *w2)
+{
+    node1_t U[M1], V[M2];
+
+    float w = init(cost, w1, w2);
+
+    if (n1 > 1 && n2 > 1)
+    {
+        for (int itr = 1; itr < MAX_ITERATIONS; itr++)
+        {
+            if (!findBasicVariables(U, V))
+                return -1;
+
+            int optimal = isOptimal(U, V);
+            if (optimal < 0)
+                return -1;
+            if (optimal)
+                break;
+
+            if (!newSol())
+                return -1;
+        }
+    }
+
+    // compute the total flow
+    double totalCost = 0;
+    for (node2_t *XP = X; XP < EndX; XP++)
+    {
+        if (XP == EnterX)               // the empty slot
+            continue;
+        if (XP->i == N1 || XP->j == N2) // dummy feature
+            continue;
+        if (XP->val == 0)               // zero flow
+            continue;
+
+        totalCost += (double)XP->val * C[XP->i][XP->j];
+    }
+
+    return (float)(totalCost / w);
+}
+
+template <int N1, int N2>
+float TransportSolver<N1, N2>::init(const float cost[N1][N2],
+        const float *w1, const float *w2)
+{
+    int i, j;
+    double sSum, dSum, diff;
+    double S[M1], D[M2];
+
+    n1 = N1;
+    n2 = N2;
+
+    maxC = 0;
+    for (i = 0; i < n1; i++)
+        for (j = 0; j < n2; j++)
+        {
+            C[i][j] = cost[i][j];
+            if (C[i][j] > maxC)
+                maxC = C[i][j];
+        }
+
+    // sum up the supply and demand
+    sSum = 0.0;
+    for (i = 0; i < n1; i++)
+    {
+        S[i] = w1[i];
+        sSum += w1[i];
+        RowsX[i] = NULL;
+    }
+    dSum = 0.0;
+    for (j = 0; j < n2; j++)
+    {
+        D[j] = w2[j];
+        dSum += w2[j];
+        ColsX[j] = NULL;
+    }
+
+    // if supply is different from demand, add a zero-cost dummy cluster
+    diff = sSum - dSum;
+    if (fabs(diff) >= EPSILON * sSum)
+    {
+        if (diff < 0.0)
+        {
+            for (j = 0; j < n2; j++)
+                C[n1][j] = 0;
+            S[n1] = -diff;
+            RowsX[n1] = NULL;
+            n1++;
+        }
+        else
+        {
+            for (i = 0; i < n1; i++)
+                C[i][n2] = 0;
+            D[n2] = diff;
+            ColsX[n2] = NULL;
+            n2++;
+        }
+    }
+
+    for (i = 0; i < n1; i++)
+        for (j = 0; j < n2; j++)
+            IsX[i][j] = 0;
+    EndX = X;
+
+    maxW = sSum > dSum ? sSum : dSum;
+
+    russel(S, D);
+
+    EnterX = EndX++;    // an empty slot (only n1+n2-1 basic variables)
+
+    return sSum > dSum ? dSum : sSum;
+}
+
+template <int N1, int N2>
+bool TransportSolver<N1, N2>::findBasicVariables(node1_t *U, node1_t *V)
+{
+    int i, j, found;
+    int UfoundNum, VfoundNum;
+    node1_t u0Head, u1Head, *CurU, *PrevU;
+    node1_t v0Head, v1Head, *CurV, *PrevV;
+
+    // initialize the rows list (U) and the columns list (V)
+    u0Head.Next = CurU = U;
+    for (i = 0; i < n1; i++)
+    {
+        CurU->i = i;
+        CurU->Next = CurU + 1;
+        CurU++;
+    }
+    (--CurU)->Next = NULL;
+    u1Head.Next = NULL;
+
+    CurV = V + 1;
+    v0Head.Next = n2 > 1 ? V + 1 : NULL;
+    for (j = 1; j < n2; j++)
+    {
+        CurV->i = j;
+        CurV->Next = CurV + 1;
+        CurV++;
+    }
+    (--CurV)->Next = NULL;
+    v1Head.Next = NULL;
+
+    // there are n1+n2 variables but only n1+n2-1 independent equations,
+    // so set V[0]=0
+    V[0].i = 0;
+    V[0].val = 0;
+    v1Head.Next = V;
+    v1Head.Next->Next = NULL;
+
+    // loop until all variables are found
+    UfoundNum = VfoundNum = 0;
+    while (UfoundNum < n1 || VfoundNum < n2)
+    {
+        found = 0;
+        if (VfoundNum < n2)
+        {
+            // loop over all marked columns
+            PrevV = &v1Head;
+            for (CurV = v1Head.Next; CurV != NULL; CurV = CurV->Next)
+            {
+                j = CurV->i;
+                // find the variables in column j
+                PrevU = &u0Head;
+                for (CurU = u0Head.Next; CurU != NULL; CurU = CurU->Next)
+                {
+                    i = CurU->i;
+                    if (IsX[i][j])
+                    {
+                        // compute U[i] and add it to the marked list
+                        CurU->val = C[i][j] - CurV->val;
+                        PrevU->Next = CurU->Next;
+                        CurU->Next = u1Head.Next != NULL ? u1Head.Next : NULL;
+                        u1Head.Next = CurU;
+                        CurU = PrevU;
+                    }
+                    else
+                        PrevU = CurU;
+                }
+                PrevV->Next = CurV->Next;
+                VfoundNum++;
+                found = 1;
+            }
+        }
+        if (UfoundNum < n1)
+        {
+            // loop over all marked rows
+            PrevU = &u1Head;
+            for (CurU = u1Head.Next; CurU != NULL; CurU = CurU->Next)
+            {
+                i = CurU->i;
+                // find the variables in row i
+                PrevV = &v0Head;
+                for (CurV = v0Head.Next; CurV != NULL; CurV = CurV->Next)
+                {
+                    j = CurV->i;
+                    if (IsX[i][j])
+                    {
+                        // compute V[j] and add it to the marked list
+                        CurV->val = C[i][j] - CurU->val;
+                        PrevV->Next = CurV->Next;
+                        CurV->Next = v1Head.Next != NULL ? v1Head.Next: NULL;
+                        v1Head.Next = CurV;
+                        CurV = PrevV;
+                    }
+                    else
+                        PrevV = CurV;
+                }
+                PrevU->Next = CurU->Next;
+                UfoundNum++;
+                found = 1;
+            }
+        }
+        if (!found)
+            return false;
+    }
+    return true;
+}
+
+template <int N1, int N2>
+int TransportSolver<N1, N2>::isOptimal(node1_t *U, node1_t *V)
+{
+    double delta, deltaMin;
+    int i, j, minI = 0, minJ = 0;
+
+    // find the minimal Cij-Ui-Vj over all i,j
+    deltaMin = EMDINF;
+    for (i = 0; i < n1; i++)
+        for (j = 0; j < n2; j++)
+            if (!IsX[i][j])
+            {
+                delta = C[i][j] - U[i].val - V[j].val;
+                if (deltaMin > delta)
+                {
+                    deltaMin = delta;
+                    minI = i;
+                    minJ = j;
+                }
+            }
+
+    if (deltaMin == EMDINF)
+        return -1;
+
+    EnterX->i = minI;
+    EnterX->j = minJ;
+
+    // if no negative deltaMin, we found the optimal solution
+    return deltaMin >= -EPSILON * maxC;
+}
+
+template <int N1, int N2>
+bool TransportSolver<N1, N2>::newSol()
+{
+    int i, j, k;
+    double xMin;
+    int steps;
+    node2_t *Loop[NX], *CurX, *LeaveX = 0;
+
+    // enter the new basic variable
+    i = EnterX->i;
+    j = EnterX->j;
+    IsX[i][j] = 1;
+    EnterX->NextC = RowsX[i];
+    EnterX->NextR = ColsX[j];
+    EnterX->val = 0;
+    RowsX[i] = EnterX;
+    ColsX[j] = EnterX;
+
+    // find a chain reaction
+    if ((steps = findLoop(Loop)) < 0)
+        return false;
+
+    // find the largest value in the loop
+    xMin = EMDINF;
+    for (k = 1; k < steps; k += 2)
+    {
+        if (Loop[k]->val < xMin)
+        {
+            LeaveX = Loop[k];
+            xMin = Loop[k]->val;
+        }
+    }
+
+    // update the loop
+    for (k = 0; k < steps; k += 2)
+    {
+        Loop[k]->val += xMin;
+        Loop[k+1]->val -= xMin;
+    }
+
+    // remove the leaving basic variable
+    i = LeaveX->i;
+    j = LeaveX->j;
+    IsX[i][j] = 0;
+    if (RowsX[i] == LeaveX)
+        RowsX[i] = LeaveX->NextC;
+    else
+        for (CurX = RowsX[i]; CurX != NULL; CurX = CurX->NextC)
+            if (CurX->NextC == LeaveX)
+            {
+                CurX->NextC = CurX->NextC->NextC;
+                break;
+            }
+    if (ColsX[j] == LeaveX)
+        ColsX[j] = LeaveX->NextR;
+    else
+        for (CurX = ColsX[j]; CurX != NULL; CurX = CurX->NextR)
+            if (CurX->NextR == LeaveX)
+            {
+                CurX->NextR = CurX->NextR->NextR;
+                break;
+            }
+
+    // set EnterX to be the new empty slot
+    EnterX = LeaveX;
+    return true;
+}
+
+template <int N1, int N2>
+int TransportSolver<N1, N2>::findLoop(node2_t **Loop)
+{
+    int i, steps;
+    node2_t **CurX, *NewX;
+    char IsUsed[NX];
+
+    for (i = 0; i < n1 + n2; i++)
+        IsUsed[i] = 0;
+
+    CurX = Loop;
+    NewX = *CurX = EnterX;
+    IsUsed[EnterX - X] = 1;
+    steps = 1;
+
+    do
+    {
+        if (steps % 2 == 1)
+        {
+            // find an unused X in the row
+            NewX = RowsX[NewX->i];
+            while (NewX != NULL && IsUsed[NewX - X])
+                NewX = NewX->NextC;
+        }
+        else
+        {
+            // find an unused X in the column, or the entering X
+            NewX = ColsX[NewX->j];
+            while (NewX != NULL && IsUsed[NewX - X] && NewX != EnterX)
+                NewX = NewX->NextR;
+            if (NewX == EnterX)
+                break;
+        }
+
+        if (NewX != NULL)
+        {
+            // found the next X - add it to the loop
+            *++CurX = NewX;
+            IsUsed[NewX - X] = 1;
+            steps++;
+        }
+        else
+        {
+            // didn't find the next X - backtrack
+            do
+            {
+                NewX = *CurX;
+                do
+                {
+                    if (steps % 2 == 1)
+                        NewX = NewX->NextR;
+                    else
+                        NewX = NewX->NextC;
+                } while (NewX != NULL && IsUsed[NewX - X]);
+
+                if (NewX == NULL)
+                {
+                    IsUsed[*CurX - X] = 0;
+                    CurX--;
+                    steps--;
+                }
+            } while (NewX == NULL && CurX >= Loop);
+
+            IsUsed[*CurX - X] = 0;
+            *CurX = NewX;
+            IsUsed[NewX - X] = 1;
+        }
+    } while (CurX >= Loop);
+
+    if (CurX == Loop)
+        return -1;
+
+    return steps;
+}
+
+template <int N1, int N2>
+void TransportSolver<N1, N2>::russel(double *S, double *D)
+{
+    int i, j, found, minI = 0, minJ = 0;
+    double deltaMin, oldVal, diff;
+    double Delta[M1][M2];
+    node1_t Ur[M1], Vr[M2];
+    node1_t uHead, *CurU, *PrevU;
+    node1_t vHead, *CurV, *PrevV;
+    node1_t *PrevUMinI = 0, *PrevVMinJ = 0, *Remember;
+
+    // initialize the rows list (Ur), and the columns list (Vr)
+    uHead.Next = CurU = Ur;
+    for (i = 0; i < n1; i++)
+    {
+        CurU->i = i;
+        CurU->val = -EMDINF;
+        CurU->Next = CurU + 1;
+        CurU++;
+    }
+    (--CurU)->Next = NULL;
+
+    vHead.Next = CurV = Vr;
+    for (j = 0; j < n2; j++)
+    {
+        CurV->i = j;
+        CurV->val = -EMDINF;
+        CurV->Next = CurV + 1;
+        CurV++;
+    }
+    (--CurV)->Next = NULL;
+
+    // find the maximum row and column values (Ur[i] and Vr[j])
+    for (i = 0; i < n1; i++)
+        for (j = 0; j < n2; j++)
+        {
+            float v;
+            v = C[i][j];
+            if (Ur[i].val <= v)
+                Ur[i].val = v;
+            if (Vr[j].val <= v)
+                Vr[j].val = v;
+        }
+
+    // compute the Delta matrix
+    for (i = 0; i < n1; i++)
+        for (j = 0; j < n2; j++)
+            Delta[i][j] = C[i][j] - Ur[i].val - Vr[j].val;
+
+    // find the basic variables
+    do
+    {
+        // find the smallest Delta[i][j]
+        found = 0;
+        deltaMin = EMDINF;
+        PrevU = &uHead;
+        for (CurU = uHead.Next; CurU != NULL; CurU = CurU->Next)
+        {
+            int i;
+            i = CurU->i;
+            PrevV = &vHead;
+            for (CurV = vHead.Next; CurV != NULL; CurV = CurV->Next)
+            {
+                int j;
+                j = CurV->i;
+                if (deltaMin > Delta[i][j])
+                {
+                    deltaMin = Delta[i][j];
+                    minI = i;
+                    minJ = j;
+                    PrevUMinI = PrevU;
+                    PrevVMinJ = PrevV;
+                    found = 1;
+                }
+                PrevV = CurV;
+            }
+            PrevU = CurU;
+        }
+
+        if (!found)
+            break;
+
+        // add X[minI][minJ] to the basis, and adjust supplies and cost
+        Remember = PrevUMinI->Next;
+        addBasicVariable(minI, minJ, S, D, PrevUMinI, PrevVMinJ, &uHead);
+
+        // update the necessary Delta[][]
+        if (Remember == PrevUMinI->Next)    // line minI was deleted
+        {
+            for (CurV = vHead.Next; CurV != NULL; CurV = CurV->Next)
+            {
+                int j;
+                j = CurV->i;
+                if (CurV->val == C[minI][j])  // column j needs updating
+                {
+                    // find the new maximum value in the column
+                    oldVal = CurV->val;
+                    CurV->val = -EMDINF;
+                    for (CurU = uHead.Next; CurU != NULL; CurU = CurU->Next)
+                    {
+                        int i;
+                        i = CurU->i;
+                        if (CurV->val <= C[i][j])
+                            CurV->val = C[i][j];
+                    }
+
+                    // if needed, adjust the relevant Delta[*][j]
+                    diff = oldVal - CurV->val;
+                    if (fabs(diff) < EPSILON * maxC)
+                        for (CurU = uHead.Next; CurU != NULL;
+                                CurU = CurU->Next)
+                            Delta[CurU->i][j] += diff;
+                }
+            }
+        }
+        else                                // column minJ was deleted
+        {
+            for (CurU = uHead.Next; CurU != NULL; CurU = CurU->Next)
+            {
+                int i;
+                i = CurU->i;
+                if (CurU->val == C[i][minJ])  // row i needs updating
+                {
+                    // find the new maximum value in the row
+                    oldVal = CurU->val;
+                    CurU->val = -EMDINF;
+                    for (CurV = vHead.Next; CurV != NULL; CurV = CurV->Next)
+                    {
+                        int j;
+                        j = CurV->i;
+                        if (CurU->val <= C[i][j])
+                            CurU->val = C[i][j];
+                    }
+
+                    // if needed, adjust the relevant Delta[i][*]
+                    diff = oldVal - CurU->val;
+                    if (fabs(diff) < EPSILON * maxC)
+                        for (CurV = vHead.Next; CurV != NULL;
+                                CurV = CurV->Next)
+                            Delta[i][CurV->i] += diff;
+                }
+            }
+        }
+    } while (uHead.Next != NULL || vHead.Next != NULL);
+}
+
+template <int N1, int N2>
+void TransportSolver<N1, N2>::addBasicVariable(int minI, int minJ,
+        double *S, double *D, node1_t *PrevUMinI, node1_t *PrevVMinJ,
+        node1_t *UHead)
+{
+    double T;
+
+    if (fabs(S[minI] - D[minJ]) <= EPSILON * maxW)  // degenerate case
+    {
+        T = S[minI];
+        S[minI] = 0;
+        D[minJ] -= T;
+    }
+    else if (S[minI] < D[minJ])                     // supply exhausted
+    {
+        T = S[minI];
+        S[minI] = 0;
+        D[minJ] -= T;
+    }
+    else                                            // demand exhausted
+    {
+        T = D[minJ];
+        D[minJ] = 0;
+        S[minI] -= T;
+    }
+
+    // X(minI,minJ) is a basic variable
+    IsX[minI][minJ] = 1;
+
+    EndX->val = T;
+    EndX->i = minI;
+    EndX->j = minJ;
+    EndX->NextC = RowsX[minI];
+    EndX->NextR = ColsX[minJ];
+    RowsX[minI] = EndX;
+    ColsX[minJ] = EndX;
+    EndX++;
+
+    // delete supply row only if the empty, and if not last row
+    if (S[minI] == 0 && UHead->Next->Next != NULL)
+        PrevUMinI->Next = PrevUMinI->Next->Next;    // remove row from list
+    else
+        PrevVMinJ->Next = PrevVMinJ->Next->Next;    // remove column from list
+}
+
+#endif
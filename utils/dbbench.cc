@@ -0,0 +1,237 @@
+/*
+ IMMS: Intelligent Multimedia Management System
+ Copyright (C) 2001-2009 Michael Grigoriev
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+*/
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/time.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include <iostream>
+#include <vector>
+#include <algorithm>
+
+#include <immsdb.h>
+#include <immsutil.h>
+#include <sqldb2.h>
+
+using std::cout;
+using std::endl;
+using std::vector;
+
+const string AppName = "dbbench";
+
+// Lock contention between the processes sharing the imms databases:
+// immsd looking up candidates and recording plays, the analyzer storing
+// acoustic data and immstool rewriting ratings, each in a process of its
+// own, as in real life. Reports how long immsd's reads take.
+
+static const int Songs = 5000;
+static const int Batch = 32;
+
+static double now()
+{
+    struct timeval tv;
+    gettimeofday(&tv, 0);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static void setup()
+{
+    ImmsDb immsdb;
+
+    AutoTransaction a;
+    for (int uid = 0; uid < Songs; ++uid)
+    {
+        Q("INSERT INTO Library ('uid', 'sid') VALUES (?, ?);")
+            << uid << uid << execute;
+        Q("INSERT INTO Ratings ('uid', 'rating') VALUES (?, ?);")
+            << uid << 75 << execute;
+        Q("INSERT INTO Last ('sid', 'last') VALUES (?, ?);")
+            << uid << (long)time(0) << execute;
+    }
+    a.commit();
+}
+
+struct Stats
+{
+    Stats() : ops(0), errors(0) {}
+    void print(const string &who)
+    {
+        std::sort(latency.begin(), latency.end());
+        cout << who << ": " << ops << " ops, " << errors << " errors";
+        if (!latency.empty())
+            cout << ", latency ms p50 "
+                << latency[latency.size() / 2] * 1000 << " p99 "
+                << latency[latency.size() * 99 / 100] * 1000 << " max "
+                << latency.back() * 1000;
+        cout << endl;
+    }
+
+    long ops, errors;
+    vector<double> latency;
+};
+
+// Candidate lookups, and a song played now and then
+static void immsd(double until)
+{
+    SqlDb db;
+    Stats reads, writes;
+    string query = "SELECT L.uid, IFNULL(R.rating, -1), IFNULL(La.last, 0) "
+        "FROM Library L LEFT JOIN Ratings R ON R.uid = L.uid "
+        "LEFT JOIN Last La ON La.sid = L.sid "
+        "WHERE L.uid IN (" + sql_placeholders(Batch) + ");";
+
+    for (int i = 0; now() < until; ++i)
+    {
+        double start = now();
+        try {
+            Q q(query);
+            for (int j = 0; j < Batch; ++j)
+                q << (int)(lrand48() % Songs);
+            while (q.next())
+                ;
+            ++reads.ops;
+        }
+        catch (SQLException &e) { ++reads.errors; }
+        reads.latency.push_back(now() - start);
+
+        if (i % 50)
+            continue;
+
+        start = now();
+        try {
+            AutoTransaction a;
+            int uid = lrand48() % Songs;
+            Q("INSERT INTO Journal VALUES (?, ?, ?, ?);")
+                << uid << 10 << 0 << (long)time(0) << execute;
+            Q("INSERT OR REPLACE INTO Last ('sid', 'last') "
+                    "VALUES (?, ?);") << uid << (long)time(0) << execute;
+            a.commit();
+            ++writes.ops;
+        }
+        catch (SQLException &e) { ++writes.errors; }
+        writes.latency.push_back(now() - start);
+    }
+
+    reads.print("immsd reads");
+    writes.print("immsd writes");
+}
+
+// Acoustic data for a few songs at a time
+static void analyzer(double until)
+{
+    SqlDb db;
+    Stats stats;
+    vector<char> blob(16 * 1024, 1);
+
+    while (now() < until)
+    {
+        double start = now();
+        try {
+            AutoTransaction a;
+            for (int i = 0; i < 10; ++i)
+            {
+                Q q("INSERT OR REPLACE INTO A.Acoustic ('uid', 'mfcc', 'bpm') "
+                        "VALUES (?, ?, ?);");
+                q << (int)(lrand48() % Songs);
+                q.bind(&blob[0], blob.size());
+                q.bind(&blob[0], 512);
+                q.execute();
+            }
+            a.commit();
+            ++stats.ops;
+        }
+        catch (SQLException &e) { ++stats.errors; }
+        stats.latency.push_back(now() - start);
+        usleep(20000);
+    }
+
+    stats.print("analyzer");
+}
+
+// Every rating, rewritten in one go
+static void immstool(double until)
+{
+    SqlDb db;
+    Stats stats;
+
+    while (now() < until)
+    {
+        double start = now();
+        try {
+            AutoTransaction a;
+            for (int uid = 0; uid < Songs; ++uid)
+                Q("UPDATE Ratings SET rating = ? WHERE uid = ?;")
+                    << (int)(lrand48() % 100) << uid << execute;
+            a.commit();
+            ++stats.ops;
+        }
+        catch (SQLException &e) { ++stats.errors; }
+        stats.latency.push_back(now() - start);
+        usleep(200000);
+    }
+
+    stats.print("immstool");
+}
+
+int main(int argc, char *argv[])
+{
+    int seconds = argc > 1 ? atoi(argv[1]) : 10;
+    if (argc > 2 && !strcmp(argv[2], "rollback"))
+        SQLDatabaseConnection::use_wal = false;
+    else if (argc > 2 && strcmp(argv[2], "wal"))
+    {
+        cout << "usage: dbbench [seconds] [wal|rollback]" << endl;
+        return -1;
+    }
+
+    char dir[] = "/tmp/dbbench.XXXXXX";
+    if (!mkdtemp(dir))
+        return -1;
+    setenv("HOME", dir, 1);
+    mkdir(get_imms_root().c_str(), 0700);
+
+    cout << "journal mode: "
+        << (SQLDatabaseConnection::use_wal ? "wal" : "rollback") << endl;
+
+    setup();
+
+    double until = now() + std::max(seconds, 1);
+    void (*roles[])(double) = { immsd, analyzer, immstool };
+    vector<pid_t> children;
+    for (size_t i = 0; i < sizeof(roles) / sizeof(*roles); ++i)
+    {
+        pid_t pid = fork();
+        if (!pid)
+        {
+            srand48(getpid());
+            roles[i](until);
+            exit(0);
+        }
+        children.push_back(pid);
+    }
+
+    for (size_t i = 0; i < children.size(); ++i)
+        waitpid(children[i], 0, 0);
+
+    string cleanup = string("rm -rf ") + dir;
+    system(cleanup.c_str());
+    return 0;
+}
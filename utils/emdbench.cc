@@ -0,0 +1,289 @@
+/*
+ IMMS: Intelligent Multimedia Management System
+ Copyright (C) 2001-2009 Michael Grigoriev
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+*/
+#include <string.h>
+#include <stdlib.h>
+#include <math.h>
+#include <sys/time.h>
+
+#include <iostream>
+#include <vector>
+#include <algorithm>
+
+#include <immsdb.h>
+#include <immsutil.h>
+
+#include <model/distance.h>
+#include <model/featurestore.h>
+#include <model/emd.h>
+
+using std::cout;
+using std::endl;
+using std::vector;
+
+const string AppName = "emdbench";
+
+// Reference implementations: the distances as they were computed
+// before the specialized solvers, through the generic emd()
+
+static float ref_cost[NUMGAUSS][NUMGAUSS];
+
+static float ref_gauss_dist(feature_t *f1, feature_t *f2)
+{
+    return ref_cost[*f1][*f2];
+}
+
+static float ref_linear_dist(feature_t *f1, feature_t *f2)
+{
+    return abs(*f1 - *f2);
+}
+
+static float ref_kl_divergence(const AcousticView &m1, int g1,
+        const AcousticView &m2, int g2)
+{
+    const float *means1 = m1.mean(g1), *vars1 = m1.var(g1);
+    const float *means2 = m2.mean(g2), *vars2 = m2.var(g2);
+
+    float total = 0;
+    for (int i = 0; i < Gaussian::NumDimensions; ++i)
+    {
+        const float MinVariance = 10.0f;
+        float var1 = std::max(vars1[i], MinVariance);
+        float var2 = std::max(vars2[i], MinVariance);
+        float dist = var1 / var2 + var2 / var1 +
+            pow(means1[i] - means2[i], 2.0f) *
+            (1.0f / var1 + 1.0f / var2);
+
+        total += dist - 2;
+    }
+    return total;
+}
+
+static float ref_gmm_distance(const AcousticView &m1, const AcousticView &m2)
+{
+    feature_t features[NUMGAUSS];
+    float w1[NUMGAUSS], w2[NUMGAUSS];
+
+    for (int i = 0; i < NUMGAUSS; ++i)
+    {
+        features[i] = i;
+        w1[i] = m1.weight(i);
+        w2[i] = m2.weight(i);
+
+        for (int j = 0; j < NUMGAUSS; ++j)
+            ref_cost[i][j] = ref_kl_divergence(m1, i, m2, j);
+    }
+
+    signature_t s1 = { NUMGAUSS, features, w1 };
+    signature_t s2 = { NUMGAUSS, features, w2 };
+    return emd(&s1, &s2, ref_gauss_dist, 0, 0);
+}
+
+static bool ref_normalize(const float *beats, float *output, int comb)
+{
+    float sum = 0;
+    for (int i = 0; i < BEATSSIZE; ++i)
+        sum += beats[i];
+
+    if (sum == 0)
+        return false;
+
+    float scale = 100.0 / sum;
+    for (int i = 0; i < BEATSSIZE; ++i)
+        output[i / comb] += beats[i] * scale;
+
+    return true;
+}
+
+static float ref_beat_distance(const float *beats1, const float *beats2)
+{
+    static const int comb = 5;
+    static const int OUTSIZE = DIVROUNDUP(BEATSSIZE, comb);
+
+    feature_t features[OUTSIZE];
+    for (int i = 0; i < OUTSIZE; ++i)
+        features[i] = i;
+
+    float b1[OUTSIZE], b2[OUTSIZE];
+    memset(b1, 0, sizeof(b1));
+    memset(b2, 0, sizeof(b2));
+
+    if (!ref_normalize(beats1, b1, comb))
+        return -1;
+    if (!ref_normalize(beats2, b2, comb))
+        return -1;
+
+    signature_t s1 = { OUTSIZE, features, b1 };
+    signature_t s2 = { OUTSIZE, features, b2 };
+    return emd(&s1, &s2, ref_linear_dist, 0, 0);
+}
+
+// Random, but roughly shaped like the analyzer's output
+static void synthesize(FeatureStore &store, int n)
+{
+    MixtureModel mm;
+    float beats[BEATSSIZE];
+
+    for (int uid = 0; uid < n; ++uid)
+    {
+        float wsum = 0;
+        for (int g = 0; g < NUMGAUSS; ++g)
+        {
+            Gaussian &gauss = mm.gauss[g];
+            gauss.weight = drand48() + 0.05;
+            wsum += gauss.weight;
+            for (int d = 0; d < Gaussian::NumDimensions; ++d)
+            {
+                gauss.means[d] = (drand48() - 0.5) * 40;
+                gauss.vars[d] = drand48() * 60 + 1;
+            }
+        }
+        for (int g = 0; g < NUMGAUSS; ++g)
+            mm.gauss[g].weight /= wsum;
+        for (int i = 0; i < BEATSSIZE; ++i)
+            beats[i] = drand48() * drand48() * 1000;
+
+        store.set(uid, mm, beats);
+    }
+}
+
+struct Result
+{
+    Result() : pairs(0), exact(0), max_diff(0), ref_usec(0), new_usec(0) {}
+    void compare(float ref, float got)
+    {
+        ++pairs;
+        if (!memcmp(&ref, &got, sizeof(float)))
+            ++exact;
+        float diff = fabs(ref - got) / std::max(fabsf(ref), 1e-6f);
+        max_diff = std::max(max_diff, diff);
+    }
+    void print(const string &name)
+    {
+        cout << name << ": " << pairs << " pairs, " << exact
+            << " bit identical, max relative difference " << max_diff
+            << endl << "    reference " << ref_usec * 1000. / pairs
+            << " ns/pair, new " << new_usec * 1000. / pairs
+            << " ns/pair" << endl;
+    }
+    int pairs, exact;
+    float max_diff;
+    uint64_t ref_usec, new_usec;
+};
+
+int main(int argc, char *argv[])
+{
+    int max_songs = argc > 1 ? atoi(argv[1]) : 300;
+
+    // Opening the databases switches them to WAL and creates tables, so
+    // the analyzed songs are read from a scratch copy
+    const char *root = getenv("IMMSROOT");
+    string source = root ? string(root) + "/" :
+        string(getenv("HOME") ? getenv("HOME") : "") + "/.imms/";
+
+    char dir[] = "/tmp/emdbench.XXXXXX";
+    if (!mkdtemp(dir))
+        return -1;
+    setenv("IMMSROOT", dir, 1);
+
+    string copy = "cp '" + source + "imms.acoustic.db' " + dir
+        + " 2>/dev/null; cp '" + source + "imms.acoustic.db-wal' " + dir
+        + " 2>/dev/null";
+    system(copy.c_str());
+
+    FeatureStore store;
+    {
+        ImmsDb immsdb;
+        store.load();
+    }
+
+    string cleanup = string("rm -rf ") + dir;
+    system(cleanup.c_str());
+
+    if (store.size() < 2)
+    {
+        cout << "no analyzed songs found - using synthetic data" << endl;
+        srand48(1);
+        synthesize(store, max_songs);
+    }
+
+    int n = std::min((int)store.size(), max_songs);
+    vector<float> ref, got;
+    Result gmm, beats, closed;
+    struct timeval start, end;
+
+    gettimeofday(&start, 0);
+    for (int i = 0; i < n; ++i)
+        for (int j = 0; j < n; ++j)
+            ref.push_back(ref_gmm_distance(store.at(i), store.at(j)));
+    gettimeofday(&end, 0);
+    gmm.ref_usec = usec_diff(start, end);
+
+    gettimeofday(&start, 0);
+    for (int i = 0; i < n; ++i)
+        for (int j = 0; j < n; ++j)
+            got.push_back(EMD::raw_distance(store.at(i), store.at(j)));
+    gettimeofday(&end, 0);
+    gmm.new_usec = usec_diff(start, end);
+
+    for (size_t i = 0; i < ref.size(); ++i)
+        gmm.compare(ref[i], got[i]);
+
+    ref.clear();
+    got.clear();
+
+    gettimeofday(&start, 0);
+    for (int i = 0; i < n; ++i)
+        for (int j = 0; j < n; ++j)
+            ref.push_back(ref_beat_distance(store.at(i).beats,
+                        store.at(j).beats));
+    gettimeofday(&end, 0);
+    beats.ref_usec = usec_diff(start, end);
+
+    gettimeofday(&start, 0);
+    for (int i = 0; i < n; ++i)
+        for (int j = 0; j < n; ++j)
+            got.push_back(EMD::raw_distance(store.at(i).beats,
+                        store.at(j).beats));
+    gettimeofday(&end, 0);
+    beats.new_usec = usec_diff(start, end);
+
+    for (size_t i = 0; i < ref.size(); ++i)
+        beats.compare(ref[i], got[i]);
+
+    got.clear();
+    EMD::closed_form_beats = true;
+
+    gettimeofday(&start, 0);
+    for (int i = 0; i < n; ++i)
+        for (int j = 0; j < n; ++j)
+            got.push_back(EMD::raw_distance(store.at(i).beats,
+                        store.at(j).beats));
+    gettimeofday(&end, 0);
+    closed.ref_usec = beats.ref_usec;
+    closed.new_usec = usec_diff(start, end);
+
+    for (size_t i = 0; i < ref.size(); ++i)
+        closed.compare(ref[i], got[i]);
+
+    gmm.print("mixture models");
+    beats.print("beat graphs");
+    closed.print("beat graphs, closed form");
+
+    return 0;
+}
@@ -25,8 +25,11 @@
 #include <map>
 #include <utility>
 #include <algorithm>
+#include <atomic>
+#include <thread>
 
 #include <assert.h>
+#include <signal.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <time.h>
@@ -39,12 +42,18 @@
 #include <immsutil.h>
 #include <strmanip.h>
 #include <picker.h>
+#include <flags.h>
+#include <rebuild.h>
 #include <appname.h>
 #include <string.h>
 
 #include <analyzer/beatkeeper.h>
 #include <analyzer/mfcckeeper.h>
+
+#include <model/acousticindex.h>
+#include <model/allpairs.h>
 #include <model/distance.h>
+#include <model/featurestore.h>
 #include <model/model.h>
 
 using std::string;
@@ -69,8 +78,11 @@ void do_purge(const string &path);
 void do_closest(const string &path);
 void do_lint();
 void do_identify(const string &path);
-void do_update_ratings();
-void do_update_distances();
+void do_update_ratings(int threads);
+void do_update_distances(int threads);
+void do_rebuild_correlations(int threads);
+void do_profile();
+int immsd_pid();
 
 int main(int argc, char *argv[])
 {
@@ -86,23 +98,23 @@ int main(int argc, char *argv[])
 
     if (!strcmp(argv[1], "ratings"))
     {
-        if (argc > 2)
+        if (argc > 3)
         {
-            cout << "huh??" << endl;
+            cout << "immstool ratings [threads]" << endl;
             return -1;
         }
 
-        do_update_ratings();
+        do_update_ratings(argc == 3 ? atoi(argv[2]) : 0);
     }
     else if (!strcmp(argv[1], "distances"))
     {
-        if (argc > 2)
+        if (argc > 3)
         {
-            cout << "huh??" << endl;
+            cout << "immstool distances [threads]" << endl;
             return -1;
         }
 
-        do_update_distances();
+        do_update_distances(argc == 3 ? atoi(argv[2]) : 0);
     }
     else if (!strcmp(argv[1], "distance"))
     {
@@ -244,10 +256,29 @@ int main(int argc, char *argv[])
             cout << OFFSET2BPM(i) << " " << beats[i] << endl;
         return 0;
     }
+    else if (!strcmp(argv[1], "rebuild-correlations"))
+    {
+        do_rebuild_correlations(argc > 2 ? atoi(argv[2]) : 0);
+    }
+    else if (!strcmp(argv[1], "compact"))
+    {
+        // immsd keeps the graph in memory, and would write it back
+        if (immsd_pid())
+        {
+            cerr << "immstool: stop immsd before compacting" << endl;
+            return -1;
+        }
+        immsdb.compact_correlations(INT_MAX);
+        immsdb.flush_correlations();
+    }
     else if (!strcmp(argv[1], "lint"))
     {
         do_lint();
     }
+    else if (!strcmp(argv[1], "profile"))
+    {
+        do_profile();
+    }
     else if (!strcmp(argv[1], "help"))
     {
         do_help();
@@ -261,9 +292,9 @@ int main(int argc, char *argv[])
 int usage()
 {
     cout << "End user functionality: " << endl;
-    cout << " immstool missing|purge|lint|identify|help" << endl;
+    cout << " immstool missing|purge|lint|compact|identify|help" << endl;
     cout << "Debug functionality: " << endl;
-    cout << " immstool distances|graph" << endl;
+    cout << " immstool distances|rebuild-correlations|graph|profile" << endl;
     return -1;
 }
 
@@ -279,6 +310,8 @@ void do_help()
         "  hint: 'immstool missing | sort | immstool purge' works well" << endl;
     cout << "    lint                   " <<
         "- vacuum the database" << endl;
+    cout << "    compact                " <<
+        "- prune weak and excess correlations" << endl;
     cout << "    identify <filename>    " <<
         "- print information about a given file" << endl;
     cout << "    help                   " << 
@@ -362,7 +395,7 @@ void do_lint()
                 Q q("SELECT path FROM Identify;");
                 while (q.next())
                 {
-                    string path;
+                    const char *path;
                     q >> path;
                     string simple = path_normalize(path);
 
@@ -413,6 +446,9 @@ void do_lint()
         Q("DELETE FROM Ratings "
                 "WHERE uid NOT IN (SELECT uid FROM Library);").execute();
 
+        Q("DELETE FROM RatingStats "
+                "WHERE uid NOT IN (SELECT uid FROM Library);").execute();
+
         Q("DELETE FROM A.Acoustic "
                 "WHERE uid NOT IN (SELECT uid FROM Library);").execute();
 
@@ -439,116 +475,196 @@ void do_missing()
 
     while (q.next())
     {
-        string path;
+        const char *path;
         q >> path;
-        if (access(path.c_str(), F_OK))
+        if (access(path, F_OK))
             cout << path << endl;
     }
 }
 
-void do_update_ratings()
+void do_update_ratings(int threads)
 {
+    struct timeval start, end;
+    gettimeofday(&start, 0);
+
+    // One pass over the journal, grouped by song
+    vector<RatingStats> stats;
     vector<int> uids;
+    vector<size_t> first;
+    vector<int> deltas;
     try
     {
-        Q q("SELECT DISTINCT uid FROM Journal;");
+        std::map<int, pair<float, float> > bias;
+        {
+            Q q("SELECT uid, sum(mean * trials) / sum(trials), sum(trials) "
+                    "FROM Bias GROUP BY uid;");
+            while (q.next())
+            {
+                int uid;
+                float mean, trials;
+                q >> uid;
+                // No trials leaves a NULL mean; such songs keep the
+                // default bias, as in Song::update_rating
+                if (q.is_null())
+                    continue;
+                q >> mean >> trials;
+                bias[uid] = pair<float, float>(mean / 100.0, trials);
+            }
+        }
+
+        Q q("SELECT uid, rowid, played, flags FROM Journal "
+                "ORDER BY uid ASC, time ASC, rowid ASC;");
         while (q.next())
         {
-            int uid;
-            q >> uid;
-            uids.push_back(uid);
+            int uid, flags;
+            long rowid;
+            time_t played;
+            q >> uid >> rowid >> played >> flags;
+
+            if (uids.empty() || uids.back() != uid)
+            {
+                uids.push_back(uid);
+                first.push_back(deltas.size());
+                stats.push_back(RatingStats());
+
+                std::map<int, pair<float, float> >::iterator i =
+                    bias.find(uid);
+                if (i != bias.end())
+                {
+                    stats.back().biasmean = i->second.first;
+                    stats.back().biastrials = i->second.second;
+                }
+            }
+
+            stats.back().journal = std::max(stats.back().journal, rowid);
+            deltas.push_back(Flags::deltify(played, flags));
         }
+        first.push_back(deltas.size());
     }
     WARNIFFAILED();
 
-    for (size_t i = 0; i < uids.size(); ++i)
-    {
-        Song song("", uids[i]);
-        song.update_rating();
-    }
-}
+    if (threads <= 0)
+        threads = std::thread::hardware_concurrency();
+    threads = std::max(threads, 1);
+
+    vector<int> ratings(uids.size());
+    std::atomic<size_t> next(0);
+    vector<std::thread> workers;
+    for (int t = 0; t < threads; ++t)
+        workers.emplace_back([&]() {
+            for (size_t i; (i = next++) < uids.size(); )
+            {
+                for (size_t d = first[i]; d < first[i + 1]; ++d)
+                    stats[i].add(deltas[d]);
+                ratings[i] = stats[i].rating();
+            }
+        });
+    for (size_t t = 0; t < workers.size(); ++t)
+        workers[t].join();
 
-void do_update_distances()
-{
-    vector<int> uids;
     try
     {
-        Q q("SELECT uid FROM A.Acoustic WHERE mfcc NOTNULL AND bpm NOTNULL;");
-        while (q.next())
+        AutoTransaction a;
+
+        Q r("INSERT OR REPLACE INTO Ratings "
+                "('uid', 'rating', 'dev') VALUES (?, ?, ?);");
+        Q s("INSERT OR REPLACE INTO RatingStats "
+                "('uid', 'journal', 'total', 'window', "
+                "'biasmean', 'biastrials') VALUES (?, ?, ?, ?, ?, ?);");
+
+        for (size_t i = 0; i < uids.size(); ++i)
         {
-            int uid;
-            q >> uid;
-            uids.push_back(uid);
+            r << uids[i] << ratings[i] << 0;
+            r.execute();
+
+            s << uids[i] << stats[i].journal << stats[i].total
+                << stats[i].encode_window() << stats[i].biasmean
+                << stats[i].biastrials;
+            s.execute();
         }
+
+        a.commit();
     }
     WARNIFFAILED();
 
-    SVMSimilarityModel model;
+    gettimeofday(&end, 0);
+    cout << "updated " << uids.size() << " ratings from " << deltas.size()
+        << " journal entries in " << usec_diff(start, end) / 1e6 << "s"
+        << endl;
+}
 
-    size_t numuids = uids.size();
-    for (size_t i = 0; i < numuids; ++i)
-    {
-        int uid = uids[i];
-        set<int> neigh;
-        neigh.insert(uids.begin(), uids.end());
-        neigh.erase(uid);
-        int x, y;
+void do_update_distances(int threads)
+{
+    FeatureStore store;
+    store.load();
 
-        try
-        {
-            Q q("SELECT x, y FROM A.Distances WHERE x = ? OR y = ?;");
-            q << uid << uid;
-            while (q.next()) 
-            {
-                q >> x >> y;
-                if (x == uid && y != uid)
-                    neigh.erase(y);
-                if (x != uid && y == uid)
-                    neigh.erase(x);
-            }
-        }
-        WARNIFFAILED();
+    AllPairs allpairs(store, threads);
+    long scored = allpairs.update();
 
-        MixtureModel m1;
-        float beats1[BEATSSIZE];
+    cout << "scored " << scored << " pairs" << endl;
+}
 
-        Song s1("", uid);
-        if (!s1.get_acoustic(&m1, beats1))
-            continue;
+void do_rebuild_correlations(int threads)
+{
+    // immsd would go on writing to the database being replaced
+    if (immsd_pid())
+    {
+        cerr << "immstool: stop immsd before rebuilding correlations"
+            << endl;
+        return;
+    }
 
-        try {
-            AutoTransaction at(true);
-            Q q("INSERT OR REPLACE INTO A.Distances ('x', 'y', 'dist') "
-                    "VALUES (?, ?, ?);");
+    struct timeval start, end;
+    gettimeofday(&start, 0);
 
-            for (set<int>::iterator j = neigh.begin(); j != neigh.end(); ++j)
-            {
-                MixtureModel m2;
-                float beats2[BEATSSIZE];
+    CorrelationRebuild rebuild(threads);
+    long edges = rebuild.run(get_imms_root("imms.correlations.db"));
+    if (edges < 0)
+    {
+        LOG(ERROR) << "rebuild failed" << endl;
+        return;
+    }
 
-                Song s2("", *j);
-                if (!s2.get_acoustic(&m2, beats2))
-                    continue;
+    gettimeofday(&end, 0);
+    double seconds = std::max(usec_diff(start, end) / 1e6, 1e-6);
 
-                int small = std::min(uid, *j);
-                int large = std::max(uid, *j);
+    cout << "rebuilt " << edges << " correlations in " << seconds
+        << "s (" << long(edges / seconds) << " edges/s)" << endl;
+}
 
-                int dist = ROUND(model.evaluate(m1, beats1, m2, beats2) * 100);
+// The pid of the running immsd, or 0 if there is none
+int immsd_pid()
+{
+    ifstream lockfile(get_imms_root(".immsd_lock").c_str());
+    int pid = 0;
+    lockfile >> pid;
+    return pid && !kill(pid, 0) ? pid : 0;
+}
 
-                // Don't bother with distance < 0.3.
-                // This way we only get a list of strongly correlated songs.
-                if (dist < 30)
-                    continue;
+void do_profile()
+{
+    int pid = immsd_pid();
+    if (!pid)
+    {
+        cerr << "immstool: immsd is not running" << endl;
+        return;
+    }
 
-                cout << "updating " << small << " -> "
-                    << large << " = " << dist << endl;
-                q << small << large << dist;
-                q.execute();
-            }
-            at.commit();
-        }
-        WARNIFFAILED();
+    string path = get_imms_root("imms.profile");
+    unlink(path.c_str());
+    kill(pid, SIGUSR1);
+
+    // immsd writes the report from its event loop
+    for (int i = 0; i < 50 && access(path.c_str(), F_OK); ++i)
+        usleep(100000);
+
+    ifstream report(path.c_str());
+    if (!report)
+    {
+        cerr << "immstool: no report from immsd" << endl;
+        return;
     }
+    cout << report.rdbuf();
 }
 
 void do_closest(const string &path)
@@ -563,28 +679,56 @@ void do_closest(const string &path)
     
     int uid = song.get_uid();
 
+    FeatureStore store;
+    store.load();
+
+    AcousticView a1;
+    if (!store.find(uid, a1))
+    {
+        cerr << "immstool: " << path << " has not been analyzed" << endl;
+        return;
+    }
+
+    AcousticIndex index;
+    if (index.load(get_imms_root(ACOUSTIC_INDEX)))
+        index.refresh(store);
+    else
+        index.build(store);
+
+    // Shortlist with the index, then rank the shortlist with the model
+    vector<int> shortlist;
+    index.nearest(a1, 10 * 25, shortlist, uid);
+
+    vector<AcousticView> others;
+    vector<int> other_uids;
+    for (size_t i = 0; i < shortlist.size(); ++i)
+    {
+        AcousticView view;
+        if (!store.find(shortlist[i], view))
+            continue;
+        others.push_back(view);
+        other_uids.push_back(shortlist[i]);
+    }
+
+    vector<float> scores(others.size());
+    SVMSimilarityModel model;
+    if (!others.empty())
+        model.evaluate_batch(a1, &others[0], others.size(), &scores[0]);
+
     multimap<int, int> closest;
 
-    try
+    for (size_t i = 0; i < others.size(); ++i)
     {
-        Q q("SELECT x,y,dist FROM A.Distances WHERE x = ? or y = ? "
-                "ORDER BY dist DESC LIMIT 25;");
-        q << uid << uid;
+        if (isnan(scores[i]))
+            continue;
 
-        int x, y, dist;
-        while (q.next())
-        {
-            q >> x >> y >> dist;
-            int other = -1;
-            if (x == uid && y != uid)
-                other = y;
-            if (x != uid && y == uid)
-                other = x;
-            if (other > 0)
-                closest.insert(pair<int, int>(dist, other));
-        }
+        int dist = ROUND(scores[i] * 100);
+        closest.insert(pair<int, int>(dist, other_uids[i]));
+
+        // Only keep the 25 closest
+        if (closest.size() > 25)
+            closest.erase(closest.begin());
     }
-    WARNIFFAILED();
 
     try 
     {
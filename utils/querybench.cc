@@ -0,0 +1,98 @@
+/*
+ IMMS: Intelligent Multimedia Management System
+ Copyright (C) 2001-2009 Michael Grigoriev
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+*/
+#include <sys/time.h>
+
+#include <iostream>
+#include <map>
+#include <sstream>
+
+#include <sqlite++.h>
+
+using std::cout;
+using std::endl;
+
+const string AppName = "querybench";
+
+// The cost of getting from a query's text to its prepared statement,
+// with as many statements cached as immsd typically has
+
+static const int Cached = 150;
+static const int Rounds = 2000000;
+
+static double now()
+{
+    struct timeval tv;
+    gettimeofday(&tv, 0);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static void report(const string &what, double seconds)
+{
+    cout << what << ": " << seconds * 1e9 / Rounds << " ns/query" << endl;
+}
+
+#define QUERY "SELECT P.pos, P.path, L.uid, L.sid, R.rating " \
+    "FROM Playlist P INNER JOIN Library L ON P.uid = L.uid " \
+    "LEFT JOIN Ratings R ON R.uid = L.uid WHERE P.pos = ?;"
+
+int main()
+{
+    SQLDatabaseConnection db(":memory:");
+    Q("CREATE TABLE Playlist ('pos' INTEGER, 'path' TEXT, 'uid' INTEGER);")
+        .execute();
+    Q("CREATE TABLE Library ('uid' INTEGER, 'sid' INTEGER);").execute();
+    Q("CREATE TABLE Ratings ('uid' INTEGER, 'rating' INTEGER);").execute();
+
+    // Fill the cache with queries that share a long prefix
+    std::map<string, sqlite3_stmt *> reference;
+    for (int i = 0; i < Cached; ++i)
+    {
+        std::ostringstream query;
+        query << QUERY << " -- " << i;
+        Q q(query.str());
+        reference[query.str()] = 0;
+    }
+    reference[QUERY] = 0;
+
+    SQLQueryManager *manager = SQLQueryManager::self();
+
+    double start = now();
+    for (int i = 0; i < Rounds; ++i)
+    {
+        // As SQLQueryManager::get used to: a string built from the
+        // literal, looked up in an ordered map
+        if (reference.find(QUERY) == reference.end())
+            return -1;
+    }
+    report("string, ordered map (before)", now() - start);
+
+    start = now();
+    for (int i = 0; i < Rounds; ++i)
+        if (!manager->get(string(QUERY)))
+            return -1;
+    report("string, hashed", now() - start);
+
+    start = now();
+    for (int i = 0; i < Rounds; ++i)
+        if (!manager->get(QUERY))
+            return -1;
+    report("literal, by address", now() - start);
+
+    return 0;
+}
@@ -65,16 +65,20 @@ void collect_samples(Samples *samples,
         const string &table_name, int CLASS)
 {
     StatCollector<float> stats;
-    float weight;
+    vector<int> uid1, uid2;
+    vector<float> weight;
     try {
     Q q("SELECT * FROM " + table_name + ";");
-    while (q.next()) {
+    q.fetch(-1, uid1, uid2, weight);
+    } WARNIFFAILED();
+
+    for (size_t i = 0; i < uid1.size(); ++i) {
         Sample s(CLASS);
-        q >> s.uid1 >> s.uid2 >> weight;
+        s.uid1 = uid1[i];
+        s.uid2 = uid2[i];
         samples->push_back(s);
-        stats.process(weight);
+        stats.process(weight[i]);
     }
-    } WARNIFFAILED();
     stats.finish();
 }
 
@@ -93,13 +97,15 @@ void collect_features(Features *features, const Samples &samples) {
         if (!s2.get_acoustic(&mm2, b2))
             continue;
 
-        vector<float> f1;
-        SimilarityModel::extract_features(mm1, b1, mm2, b2, &f1);
+        vector<float> f1, f2;
+        if (!SimilarityModel::extract_features(mm1, b1, mm2, b2, &f1))
+            continue;
+        if (!SimilarityModel::extract_features(mm2, b2, mm1, b1, &f2))
+            continue;
+
         f1.push_back(samples[i].CLASS);
         features->push_back(f1);
 
-        vector<float> f2;
-        SimilarityModel::extract_features(mm2, b2, mm1, b1, &f2);
         f2.push_back(samples[i].CLASS);
         features->push_back(f2);
     }